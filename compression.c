@@ -1,30 +1,593 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
-#define MAX_TREE_HT 100
+#include "compression.h"
+
 #define MAX_CHARS 256
-#define MAX_PATH_LEN 256
+#define MAX_PATH_LEN 4096
+
+// Longest code length, the most a packed 4-bit length nibble can hold
+#define MAX_CODE_LEN 15
+
+// Format version 2: magic, 64-bit original size, then the canonical code
+// length of every byte value packed two per byte (low nibble first)
+#define FORMAT_MAGIC "HUF\x02"
+#define FORMAT_MAGIC_LEN 4
+#define CODE_LENGTHS_SIZE (MAX_CHARS / 2)
+#define HEADER_SIZE (FORMAT_MAGIC_LEN + 8 + CODE_LENGTHS_SIZE)
+
+// Format version 3: magic, varint nominal block size, then self-contained
+// blocks (type byte, varint original size, varint payload size, payload) up to
+// a BLOCK_END byte. Huffman payloads hold the packed code lengths followed by
+// the block's bitstream, so every block decodes on its own.
+#define BLOCK_FORMAT_MAGIC "HUF\x03"
+#define BLOCK_END 0
+#define BLOCK_HUFFMAN 1
+#define DEFAULT_BLOCK_SIZE ((size_t)1 << 20)
+#define MAX_BLOCK_SIZE ((size_t)1 << 30)
+#define BLOCK_BOUND(n) (CODE_LENGTHS_SIZE + STREAM_JUMP_SIZE + 2 * (size_t)(n) + 8)
+
+// BLOCK_HUFFMAN4 payloads split the block into STREAM_COUNT quarters coded as
+// separate bitstreams with one shared table: packed code lengths, a jump table
+// of the first three stream sizes (32-bit little-endian), then the streams.
+// Quarters hold n / 4 bytes; the last one takes the remainder. The decoder
+// advances all four bit readers in one loop. Blocks shorter than
+// MIN_STREAMS_BLOCK stay single-stream.
+#define BLOCK_HUFFMAN4 2
+#define STREAM_COUNT 4
+#define STREAM_JUMP_SIZE (4 * (STREAM_COUNT - 1))
+#define MIN_STREAMS_BLOCK 1024
+#define BLOCK_HEADER_MAX (1 + 2 * 10)
+
+// Blocks that Huffman coding can't shrink by at least 1 / MIN_CODED_GAIN of
+// their size, judged by the entropy of their histogram, are written as
+// BLOCK_STORED (the bytes themselves). Blocks of one repeated byte are
+// BLOCK_SINGLE, whose payload is that byte. Both decode without a table.
+#define BLOCK_STORED 3
+#define BLOCK_SINGLE 4
+#define MIN_CODED_GAIN 32
+
+// BLOCK_LZ payloads (-z) replace repeats with matches inside the block: a
+// varint sequence count, then LZ_STREAMS sections laid out like block records
+// (type byte, varint size, varint payload size, payload) holding the literals,
+// the length codes, the distance codes and the extra bits. Each section is
+// itself a Huffman, stored or single-byte payload with its own table. A
+// sequence is a literal run, a match length minus LZ_MIN_MATCH and a distance
+// minus one; literals left after the last sequence end the block. Lengths and
+// distances are a code byte, LZ_DIRECT_CODES values sent as they are and then
+// four codes per power of two, followed by the low bits of the value as
+// extra bits. Blocks shorter than LZ_MIN_BLOCK aren't searched.
+#define BLOCK_LZ 5
+#define LZ_STREAMS 4
+#define LZ_MIN_MATCH 4
+#define LZ_MIN_BLOCK 32
+#define LZ_DIRECT_CODES 16
+#define LZ_EXTRA_BOUND(seqs) (11 * (size_t)(seqs) + 8)
+
+// Match finder: positions are hashed on their first LZ_HASH_BYTES bytes (read
+// as one 64-bit word, so the last LZ_LOOKAHEAD - 1 bytes of a block never
+// start a match) into a table of at most 2^LZ_HASH_BITS entries. After a run
+// of misses the search skips ahead by one more byte every 2^LZ_SKIP_SHIFT
+// bytes, or every 2^LZ_FAST_SKIP_SHIFT at level 1.
+#define LZ_HASH_BYTES 6
+#define LZ_LOOKAHEAD 8
+#define LZ_HASH_BITS 16
+#define LZ_SKIP_SHIFT 8
+#define LZ_FAST_SKIP_SHIFT 6
+#define LZ_MAX_LEVEL 9
+#define DEFAULT_LZ_WINDOW ((size_t)1 << 20)
+
+// BLOCK_ANS payloads code the bytes with tANS instead of a prefix code, which
+// spends fractions of a bit on bytes that are far more likely than one half.
+// A byte holds the table log (bits 0-3) and the padding bits in front of the
+// bitstream (bits 4-6), then comes each byte value's count out of 2^log as an
+// exp-Golomb code (count + 1), then the bitstream. Byte i is coded with state
+// i % ANS_STATES. The encoder runs backwards over the block and ends with the
+// states, so the stream starts with them and is read forwards. The block
+// coder picks BLOCK_ANS over Huffman codes when its cost is smaller.
+#define BLOCK_ANS 6
+#define ANS_STATES 4
+#define ANS_MIN_LOG 5
+#define ANS_MAX_LOG 11
+#define ANS_TABLE_SIZE (1 << ANS_MAX_LOG)
+
+// BLOCK_CONTEXT payloads (-C) code each byte with one of up to CONTEXT_TABLES
+// prefix codes, picked by the byte before it (a zero before the first byte).
+// Byte values followed by similar bytes share a code: the block's order-1
+// histograms are clustered, with CONTEXT_ROUNDS rounds of refinement. The
+// payload holds the number of codes, the code of each byte value (4 bits
+// each, two per byte), the packed code lengths of every code, then a jump
+// table and four streams as in BLOCK_HUFFMAN4, each starting after a zero.
+// Codes are at most DECODE_ROOT_BITS long, so every byte decodes with a
+// single lookup, and the streams keep four lookups in flight.
+#define BLOCK_CONTEXT 7
+#define CONTEXT_TABLES 16
+#define CONTEXT_MAP_SIZE (MAX_CHARS / 2)
+#define CONTEXT_ROUNDS 4
+#define CONTEXT_MIN_BLOCK 4096
+
+// The end byte is followed by a block index (varint block count, then each
+// block's record size and original size as varints) and a fixed trailer: the
+// index offset as a 64-bit little-endian integer and INDEX_MAGIC. Record
+// offsets follow from the sizes, starting right after the header.
+#define INDEX_MAGIC "HUFX"
+#define INDEX_TRAILER_SIZE (8 + 4)
+#define INDEX_BOUND(count) (10 + 2 * 10 * (size_t)(count) + INDEX_TRAILER_SIZE)
+
+// Range reads (-R, huff_reader) find the blocks that cover a range through
+// the index and keep the last RANGE_CACHE_BLOCKS blocks they decoded, so
+// nearby reads don't decode the same block again
+#define RANGE_CACHE_BLOCKS 4
+// Dictionary mode: a table file holds TABLE_MAGIC, the table ID (32-bit
+// little-endian, a hash of the lengths) and the packed code lengths of all
+// 256 byte values. Format version 4 codes a message with such a table: magic,
+// table ID, varint original size, then the bitstream. Up to MAX_TABLES tables
+// can be loaded at once.
+#define TABLE_MAGIC "HUFT"
+#define TABLE_FILE_SIZE (FORMAT_MAGIC_LEN + 4 + CODE_LENGTHS_SIZE)
+#define TABLE_FORMAT_MAGIC "HUF\x04"
+#define TABLE_HEADER_MAX (FORMAT_MAGIC_LEN + 4 + 10)
+#define TABLE_BOUND(n) (TABLE_HEADER_MAX + 2 * (size_t)(n) + 8)
+#define MAX_TABLES 64
+
+#define MAX_THREADS 256
+#define POOL_QUEUE_SIZE 64
+
+// Table-driven decoder: one root lookup of DECODE_ROOT_BITS bits, longer codes
+// continue through DECODE_SUB_BITS-wide sub-tables (one per internal tree node)
+#define DECODE_ROOT_BITS 11
+#define DECODE_SUB_BITS 4
+#define DECODE_TABLE_SIZE ((1 << DECODE_ROOT_BITS) + (MAX_CHARS - 1) * (1 << DECODE_SUB_BITS))
+
+// The bit coding loops are compiled once per instruction set, and the best
+// set the CPU supports is picked at startup (-k forces one). On x86 the BMI2
+// set shifts by code lengths with SHLX/SHRX and masks with BZHI.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KERNEL_TARGETS 1
+#else
+#define KERNEL_TARGETS 0
+#endif
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#define IO_BUFFER_SIZE (1 << 20)
+
+// Buffers of IO_BUFFER_SIZE bytes that a reader thread may fill ahead of the
+// codec, or that wait for a writer thread behind it (-q)
+#define IO_DEPTH 4
+#define MAX_IO_DEPTH 64
+
+// Histogram kernel: buffers shorter than HISTOGRAM_MIN_TABLES are counted
+// directly; longer ones go through HISTOGRAM_TABLES 32-bit counter tables that
+// are folded into the 64-bit totals at least every HISTOGRAM_SLICE bytes.
+// Mapped inputs of PARALLEL_HISTOGRAM_MIN bytes or more are split across -T threads.
+#define HISTOGRAM_TABLES 4
+#define HISTOGRAM_MIN_TABLES 4096
+#define HISTOGRAM_SLICE ((size_t)1 << 30)
+#define PARALLEL_HISTOGRAM_MIN ((size_t)16 << 20)
+
+// Single-pass mode (-S): the code table comes from SAMPLE_CHUNKS slices of
+// SAMPLE_CHUNK bytes spread evenly over the input instead of a full counting pass
+#define SAMPLE_CHUNKS 64
+#define SAMPLE_CHUNK ((size_t)16 << 10)
+
+// Benchmarks: size of the histogram benchmark's synthetic inputs (-H) and the
+// default number of timed runs (-n)
+#define BENCH_SAMPLE_SIZE ((size_t)64 << 20)
+#define BENCH_RUNS 5
+
+// Batch mode output names: compressing appends COMPRESSED_EXT; decompressing
+// strips it, or appends DECOMPRESSED_EXT to names that lack it
+#define COMPRESSED_EXT ".huf"
+#define DECOMPRESSED_EXT ".out"
+
+// Codec stages timed in CodecStats
+#define STAGE_HISTOGRAM 0
+#define STAGE_MATCH 1
+#define STAGE_TABLES 2
+#define STAGE_CODING 3
+#define STAGES 4
+
+// Progress (-p) is sampled by a timer thread every PROGRESS_INTERVAL_MS
+#define PROGRESS_INTERVAL_MS 250
+
+// Longest code the compressor may emit (-l option, 1 to MAX_CODE_LEN)
+static int maxCodeLength = MAX_CODE_LEN;
+
+// Block mode (-b block size, -T threads); a block size of 0 compresses the
+// whole file as one stream in format version 2
+static size_t blockSize = 0;
+static int numThreads = 1;
+
+// Data stream for output path "-" (see reserveStdout)
+static FILE* dataOut = NULL;
+
+// Map regular files into memory instead of reading them through buffers
+// (-M turns this off)
+static int useMmap = 1;
+
+// Code blocks as BLOCK_HUFFMAN4 with four interleaved streams (-4)
+static int useStreams = 0;
+
+// Let blocks use tANS where it beats Huffman codes (-A turns it off)
+static int useAns = 1;
+
+// Code blocks with order-1 context tables where that is smaller (-C)
+static int useContext = 0;
+
+// Match finder effort (-z, 0 for none) and how far back matches may reach (-w)
+static int lzLevel = 0;
+static size_t lzWindow = DEFAULT_LZ_WINDOW;
+
+// Build the whole-file code table from a sample and read the input once (-S)
+static int sampleMode = 0;
+
+// Buffers in flight between the codec and its reader and writer threads (-q);
+// 0 reads and writes synchronously
+static int ioDepth = IO_DEPTH;
+
+// Benchmark runs per input (-n) and JSON results file (-j): benchmark
+// results, or the codec stats of a -c/-d run
+static int benchRuns = BENCH_RUNS;
+static const char* jsonPath = NULL;
+
+// Step-by-step and summary messages (-v); off by default and in batch mode
+static int verbose = 0;
+
+// Show progress on standard error (-p)
+static int showProgress = 0;
+
+// Decode table entry: bits 0-7 symbol, bits 8-15 bits to consume, bits 16-30
+// sub-table offset, bit 31 set when the entry links to a sub-table.
+// An all-zero entry marks a bit pattern that no code maps to.
+#define ENTRY_LINK 0x80000000u
+#define ENTRY_BITS(e) (((e) >> 8) & 0xFF)
+#define ENTRY_OFFSET(e) (((e) >> 16) & 0x7FFF)
+
+// Symbol frequency and its position in the caller's list, sorted for the
+// two-queue code length build
+struct SymbolWeight {
+    uint64_t freq;
+    int index;
+    };
 
 // Huffman tree node
 struct MinHeapNode {
     unsigned char data;  // Character
-    unsigned freq;       // Frequency
+    uint64_t freq;       // Frequency
     struct MinHeapNode* left, * right;
     };
 
+// Node storage for one tree: MAX_CHARS leaves and MAX_CHARS - 1 internal
+// nodes, so building a tree never allocates
+#define MAX_TREE_NODES (2 * MAX_CHARS - 1)
+
+struct HuffmanArena {
+    struct MinHeapNode node[MAX_TREE_NODES];
+    int used;
+    };
+
 // Min Heap structure (Priority Queue)
 struct MinHeap {
     unsigned size;
-    unsigned capacity;
-    struct MinHeapNode** array;
+    struct MinHeapNode* array[MAX_CHARS];
+    };
+
+// Fixed-size worker pool. Without worker threads, tasks run in the caller.
+struct ThreadPool {
+    pthread_t threads[MAX_THREADS];
+    int num_threads;
+    void (*task_fn[POOL_QUEUE_SIZE])(void*);
+    void* task_arg[POOL_QUEUE_SIZE];
+    int head;      // Oldest queued task
+    int queued;    // Tasks waiting for a worker
+    int running;   // Tasks being run
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t task_ready;
+    pthread_cond_t task_done;
+    };
+
+// Counters filled in by the codec. Stage times are summed over worker
+// threads, so with -T they can add up to more than the elapsed time.
+struct CodecStats {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t ns[STAGES];
+    uint64_t tables_built;   // Encode and decode tables built
+    uint64_t blocks;         // Blocks coded; a whole-file stream counts as one
+    };
+
+// Settings that shape how a block is coded
+struct CodecOptions {
+    int max_code_len;             // Longest code (1 to MAX_CODE_LEN)
+    int streams;                  // Code blocks as BLOCK_HUFFMAN4
+    int ans;                      // Allow BLOCK_ANS
+    int context;                  // Allow BLOCK_CONTEXT
+    int lz_level;                 // Match finder effort, 0 for none
+    size_t lz_window;             // Longest match distance
+    struct CodecStats* stats;     // Where to count the work, or NULL
+    };
+
+// Match finder effort of one -z level: positions checked per search (0 keeps
+// one position per hash and skips ahead faster through data without
+// matches), whether a match one byte later may replace the one found, and the
+// length that ends a search early
+struct LzLevel {
+    int chain;
+    int lazy;
+    int nice;
+    };
+
+// One block handed to a worker: input slice and its compressed payload
+struct BlockJob {
+    const struct CodecOptions* options;
+    const unsigned char* in;
+    size_t in_size;
+    unsigned char* out;      // BLOCK_BOUND(block size) bytes
+    size_t out_size;
+    int type;                // Block type of the payload
+    uint64_t limit_cost;     // Bits added by the code length limit
+    };
+
+// Location of one block in the compressed file and in the original data
+struct BlockIndexEntry {
+    uint64_t offset;           // Start of the block record in the compressed file
+    uint64_t size;             // Record size: type byte, both sizes and payload
+    uint64_t original_offset;  // Position of the block's bytes in the output
+    uint64_t original_size;
+    };
+
+// One slice of a parallel histogram and its byte counts
+struct HistogramJob {
+    const unsigned char* data;
+    size_t size;
+    uint64_t freq[MAX_CHARS];
+    };
+
+// Fastest time of each benchmark stage over all runs, in seconds
+struct BenchResult {
+    double histogram;
+    double build;          // Code lengths, canonical codes and encode tables
+    double encode;
+    double decode_build;   // Decode tables
+    double decode;
+    double io;             // Compressed image through a temporary file
+    double compress;       // Whole huff_compress call
+    double decompress;     // Whole huff_decompress call
+    uint64_t compressed;   // Size of the huff_compress output
+    };
+
+// Read-only mapping of a whole input file
+struct MappedFile {
+    unsigned char* data;
+    size_t size;
+    };
+
+// Shared state of a parallel decompression; workers claim blocks in order
+struct ParallelDecode {
+    const struct BlockIndexEntry* index;
+    uint64_t count;
+    uint64_t block_size;
+    int in_fd;
+    int out_fd;
+    const unsigned char* in_map;   // Mapped input and output, or NULL to use
+    unsigned char* out_map;        // pread/pwrite on the descriptors
+    uint64_t next;   // Next unclaimed block
+    int failed;      // 0, HUFF_ERROR_CORRUPT or HUFF_ERROR_MEMORY
+    };
+
+// Flat lookup table used by the decoder instead of walking the tree
+struct DecodeTable {
+    uint32_t entry[DECODE_TABLE_SIZE];
+    unsigned used;  // Entries handed out so far (root table + sub-tables)
+    int max_len;    // Longest code; tables with max_len <= DECODE_ROOT_BITS never link
+    };
+
+// tANS decode table: per state, the base of the next state in bits 0-15, the
+// byte in bits 16-23 and the bits to read for the next state in bits 24-31
+struct AnsDecodeTable {
+    uint32_t entry[ANS_TABLE_SIZE];
+    };
+
+// Decode table plus the packed code lengths it was built from, so blocks that
+// repeat the previous block's code skip the rebuild
+struct DecodeCache {
+    int valid;
+    unsigned char lengths[CODE_LENGTHS_SIZE];
+    struct DecodeTable table;
+    struct AnsDecodeTable ans;   // Rebuilt for every BLOCK_ANS payload
+    uint32_t context[CONTEXT_TABLES << DECODE_ROOT_BITS];   // Root tables of a BLOCK_CONTEXT payload
+    struct CodecStats* stats;   // Where to count the work, or NULL
+    };
+
+// One decoded block kept by a range reader
+struct CachedBlock {
+    unsigned char* data;   // Block size bytes, allocated on first use
+    uint64_t block;        // Index of the block held, or UINT64_MAX
+    uint64_t used;         // Reader clock at the last use
+    };
+
+// Encoder code table: per byte value, the code in stream bit order (first bit
+// in the LSB) in bits 0-15 and the code length in bits 16-23
+struct EncodeTable {
+    uint32_t entry[MAX_CHARS];
+    int max_len;   // Longest code, which picks the encode loop
+    };
+
+// tANS encoder: per byte value, the offset that turns a state into its bit
+// count (in the top 16 bits) and where its states start in the state table,
+// then the next state for each (state >> bits) of each byte value. States run
+// from 2^log to 2^(log + 1).
+struct AnsEncodeTable {
+    uint32_t delta_bits[MAX_CHARS];
+    int32_t delta_state[MAX_CHARS];
+    uint16_t state[ANS_TABLE_SIZE];
+    int log;
+    };
+
+// Order-1 statistics of a block for BLOCK_CONTEXT: how often each byte value
+// follows each other one, as a list of (byte, count) per previous byte, and
+// the clusters those previous byte values were grouped into
+struct ContextModel {
+    uint32_t pair[MAX_CHARS][MAX_CHARS];          // [previous byte][byte]
+    uint64_t total[MAX_CHARS];                    // Bytes that follow each byte value
+    uint32_t first[MAX_CHARS + 1];                // Where each byte value's list starts
+    unsigned char next[MAX_CHARS * MAX_CHARS];
+    uint32_t count[MAX_CHARS * MAX_CHARS];
+    uint64_t cluster[CONTEXT_TABLES][MAX_CHARS];  // Histogram of each cluster
+    int map[MAX_CHARS];                           // Cluster of each previous byte value
+    struct EncodeTable code[CONTEXT_TABLES];
+    };
+
+// Ring of buffers between the codec and a thread that reads or writes a file.
+// The producer fills the buffer after the 'full' ones, the consumer empties
+// the one at 'head'.
+struct IoRing {
+    FILE* file;
+    int writing;
+    int depth;          // Buffers in the ring; 0 means plain stdio calls
+    unsigned char* buffer[MAX_IO_DEPTH];
+    size_t length[MAX_IO_DEPTH];
+    int head;           // Oldest full buffer
+    int full;           // Buffers waiting for the consumer
+    size_t offset;      // Codec's position in the buffer it is using
+    int end;            // Reader reached end of file, or writer has all the data
+    int stop;           // Reader should quit
+    int error;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    };
+
+// Trained code table (dictionary mode) with its encode and decode tables built
+struct TrainedTable {
+    uint32_t id;
+    unsigned char lengths[CODE_LENGTHS_SIZE];
+    struct EncodeTable encode;
+    struct DecodeTable decode;
+    };
+
+// Loaded trained tables, looked up by ID
+struct TableCache {
+    int count;
+    struct TrainedTable* table[MAX_TABLES];
+    };
+
+// Tables loaded with -D; the last one loaded codes compressed files
+static struct TableCache tableCache;
+static struct TrainedTable* dictTable = NULL;
+
+// Work done by the command line codec, written out by -j
+static struct CodecStats codecStats;
+
+// Progress of the running operation. The codec stores how far it got after
+// each buffer or block; a timer thread samples it (see progressStart).
+// Batch mode counts whole files here and the per-file updates are ignored.
+struct Progress {
+    const char* label;
+    uint64_t total;
+    uint64_t done;
+    int batch;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    };
+
+static struct Progress progressState;
+
+// 64-bit bit accumulator that flushes whole bytes into a large output buffer
+struct BitWriter {
+    struct IoRing* ring;
+    unsigned char* buffer;
+    unsigned char* pos;
+    uint64_t bits;       // Pending bits, oldest bit in the LSB
+    int count;           // Number of pending bits (always below 8 between calls)
+    uint64_t written;    // Bytes written to the file so far
+    };
+
+// 64-bit LSB-first bit reader over a buffered input file
+struct BitReader {
+    struct IoRing* ring;
+    unsigned char* buffer;
+    const unsigned char* pos;
+    const unsigned char* end;
+    uint64_t bits;   // Pending bits, next bit in the LSB
+    int count;       // Number of valid bits in 'bits'
+    long padding;    // Zero bytes supplied past the end of the file
+    };
+
+// One build of the bit coding loops, for the instruction set it is named
+// after (see selectKernels)
+struct CodecKernels {
+    const char* name;
+    int (*supported)(void);   // Whether the CPU has the instructions, or NULL
+    void (*encode)(const struct EncodeTable* table, struct BitWriter* bw, const unsigned char* in, size_t n);
+    int (*decode)(const struct DecodeTable* table, struct BitReader* br, unsigned char* out, size_t n);
+    int (*decodeStreams)(const struct DecodeTable* table, struct BitReader br[], unsigned char* out[], size_t n);
+    unsigned char* (*encodeAns)(const struct AnsEncodeTable* table, const unsigned char* in, size_t n,
+        unsigned char* end, int* padding);
+    void (*decodeAns)(const struct AnsDecodeTable* table, struct BitReader* br, uint32_t state[],
+        unsigned char* out, size_t n);
+    void (*encodeContext)(const struct EncodeTable* const code[], struct BitWriter* bw, const unsigned char* in,
+        size_t n);
+    int (*decodeContext)(const uint32_t* tables, const uint32_t* entry[], struct BitReader br[],
+        unsigned char* out[], size_t n);
+    };
+
+// One file of a batch run
+struct BatchJob {
+    char* input;
+    char* output;
+    uint64_t size;             // Input size, for scheduling
+    struct BatchList* state;
+    };
+
+// Files of a batch run, its settings and the totals of the finished files
+struct BatchList {
+    struct BatchJob* job;
+    size_t count;
+    size_t capacity;
+    char mode;                 // 'c' or 'd'
+    int force;                 // Overwrite existing outputs (-f)
+    const char* out_dir;       // Output directory (-o), or NULL to write next to inputs
+    pthread_mutex_t lock;      // Guards the totals
+    uint64_t failed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    };
+
+// Working memory for benchmarking one input: per-block histograms, tables and
+// bitstreams of the stage-by-stage run, plus buffers for the library round trip
+struct BenchState {
+    huff_ctx* ctx;
+    size_t blocks;
+    uint64_t (*freq)[MAX_CHARS];
+    int (*lens)[MAX_CHARS];
+    struct EncodeTable* encode;
+    struct DecodeTable* decode;
+    unsigned char* packed;       // Block b's bitstream at b * BLOCK_BOUND(DEFAULT_BLOCK_SIZE)
+    size_t* packed_size;
+    unsigned char* compressed;   // huff_compress_bound bytes
+    unsigned char* decoded;
     };
 
 // Function prototypes
-struct MinHeapNode* newNode(unsigned char data, unsigned freq);
-struct MinHeap* createMinHeap(unsigned capacity);
+struct MinHeapNode* newNode(struct HuffmanArena* arena, unsigned char data, uint64_t freq);
 void swapMinHeapNode(struct MinHeapNode** a, struct MinHeapNode** b);
 void minHeapify(struct MinHeap* minHeap, int idx);
 int isSizeOne(struct MinHeap* minHeap);
@@ -32,19 +595,133 @@ struct MinHeapNode* extractMin(struct MinHeap* minHeap);
 void insertMinHeap(struct MinHeap* minHeap, struct MinHeapNode* minHeapNode);
 void buildMinHeap(struct MinHeap* minHeap);
 int isLeaf(struct MinHeapNode* root);
-struct MinHeap* createAndBuildMinHeap(unsigned char data[], int freq[], int size);
-struct MinHeapNode* buildHuffmanTree(unsigned char data[], int freq[], int size);
-void printCodes(struct MinHeapNode* root, int arr[], int top);
-void storeCodes(struct MinHeapNode* root, int arr[], int top, char* huffmanCodes[]);
-void HuffmanCodes(unsigned char data[], int freq[], int size, char* huffmanCodes[]);
-void countFrequency(FILE* file, int freq[], long* fileSize);
-void compressFile(const char* input_file, const char* output_file);
-void decompressFile(const char* input_file, const char* output_file);
+void createAndBuildMinHeap(struct MinHeap* minHeap, struct HuffmanArena* arena, unsigned char data[],
+    uint64_t freq[], int size);
+struct MinHeapNode* buildHuffmanTree(unsigned char data[], uint64_t freq[], int size, struct HuffmanArena* arena);
+void limitCodeLengths(const uint64_t weight[], int n, int max_len, int lens[]);
+void huffmanDepths(const struct SymbolWeight sorted[], int n, int depth[]);
+void buildCodeLengths(unsigned char data[], uint64_t freq[], int size, int max_len, int lens[],
+    uint64_t* limit_cost);
+void assignCanonicalCodes(const int lens[], uint64_t codes[]);
+void HuffmanCodes(unsigned char data[], uint64_t freq[], int size, int lens[], uint64_t codes[]);
+void buildEncodeTable(struct EncodeTable* table, const uint64_t codes[], const int lens[]);
+void writeCodeLengths(const int lens[], unsigned char packed[]);
+int readCodeLengths(const unsigned char packed[], int lens[]);
+void countFrequency(FILE* file, uint64_t freq[], uint64_t* fileSize);
+void countMemoryFrequency(const unsigned char* data, size_t size, uint64_t freq[], uint64_t* fileSize);
+uint64_t countSampleFrequency(FILE* file, const struct MappedFile* map, uint64_t size, uint64_t freq[]);
+uint64_t codedBits(const uint64_t freq[], const int lens[]);
+void noteSampleCost(const uint64_t exact[], const int lens[]);
+FILE* openInput(const char* path);
+void reserveStdout(void);
+FILE* openOutput(const char* path);
+int mapInputFile(FILE* file, struct MappedFile* map);
+void unmapFile(struct MappedFile* map);
+unsigned char* mapOutputFile(FILE* file, uint64_t size);
+int decompressMapped(const struct MappedFile* map, FILE* out, uint64_t* decoded);
+int compressFile(const char* input_file, const char* output_file);
+int decompressFile(const char* input_file, const char* output_file);
+int decompressRange(const char* input_file, const char* output_file, uint64_t offset, uint64_t length);
 int validatePath(const char* path, int isInputFile);
-long getFileSize(const char* filename);
+void note(const char* format, ...);
+char* batchOutputPath(const char* rel, const char* out_dir, char mode);
+int batchAdd(struct BatchList* list, const char* input, const char* rel, uint64_t size);
+int batchWalk(struct BatchList* list, const char* dir, const char* rel);
+int batchCollect(struct BatchList* list, const char* arg, int recursive);
+int makeParentDirs(const char* path);
+void batchTask(void* arg);
+int batchRun(char mode, int count, char* args[], const char* out_path, int recursive, int force, int workers);
+void countBufferFrequency(const unsigned char* buffer, size_t n, uint64_t freq[]);
+void histogramTask(void* arg);
+int countFrequencyParallel(const unsigned char* data, size_t size, uint64_t freq[], int threads);
+void fillTextSample(unsigned char* buf, size_t n, uint32_t seed);
+void fillLowEntropySample(unsigned char* buf, size_t n, uint32_t seed);
+double benchmarkHistogramKernel(int kernel, const unsigned char* data, size_t size, uint64_t freq[]);
+int benchmarkHistogram(int count, char* files[]);
+void fillRandomSample(unsigned char* buf, size_t n, uint32_t seed);
+void fillSkewedSample(unsigned char* buf, size_t n, uint32_t seed);
+long peakRssKb(void);
+int benchmarkStages(struct BenchState* st, const unsigned char* data, size_t size, struct BenchResult* r);
+void benchKeep(double* best, double elapsed);
+double benchRate(size_t size, double elapsed);
+int benchmarkInput(const char* name, const unsigned char* data, size_t size, FILE* json);
+int benchmarkCorpus(int count, char* files[]);
+int writeVarint(unsigned char* out, uint64_t value);
+int readVarintFile(FILE* file, uint64_t* value);
+int readVarint(const unsigned char** pos, const unsigned char* end, uint64_t* value);
+size_t packBlockIndex(unsigned char* out, const struct BlockIndexEntry* index, uint64_t count, uint64_t index_offset);
+int writeBlockIndex(struct IoRing* out, const struct BlockIndexEntry* index, uint64_t count, uint64_t index_offset);
+struct BlockIndexEntry* parseBlockIndex(const unsigned char* tail, size_t tail_size, uint64_t file_size,
+    uint64_t data_start, uint64_t* count);
+struct BlockIndexEntry* readBlockIndex(FILE* in, uint64_t data_start, uint64_t* count);
+int poolInit(struct ThreadPool* pool, int threads);
+void poolSubmit(struct ThreadPool* pool, void (*fn)(void*), void* arg);
+void poolWait(struct ThreadPool* pool);
+void poolDestroy(struct ThreadPool* pool);
+uint32_t tableId(const unsigned char lengths[]);
+void trainTable(const uint64_t freq[], int max_len, unsigned char file[]);
+struct TrainedTable* findTable(const struct TableCache* cache, uint32_t id);
+struct TrainedTable* loadTable(struct TableCache* cache, const unsigned char* file, size_t size);
+void freeTables(struct TableCache* cache);
+size_t compressWithTable(const struct TrainedTable* table, const unsigned char* in, size_t n, unsigned char* out);
+int compressWithDictionary(FILE* in, const char* output_file);
+int trainFiles(const char* table_path, int count, char* files[]);
+int loadTableFile(const char* path);
+void ioStart(struct IoRing* ring, FILE* file, int writing);
+size_t ioRead(struct IoRing* ring, void* dst, size_t n);
+void ioWrite(struct IoRing* ring, const void* src, size_t n);
+int ioFinish(struct IoRing* ring);
+double entropyBits(const uint64_t freq[], uint64_t n);
+int worthCoding(const uint64_t freq[], uint64_t n);
+size_t compressLz(const struct CodecOptions* options, const unsigned char* in, size_t n, unsigned char* out,
+    size_t limit, uint64_t* limit_cost);
+int decompressLz(struct DecodeCache* cache, const unsigned char* in, size_t size, unsigned char* out, size_t n);
+size_t compressBlock(const struct CodecOptions* options, const unsigned char* in, size_t n, unsigned char* out,
+    int* type, uint64_t* limit_cost);
+int decompressBlockCached(struct DecodeCache* cache, int type, const unsigned char* in, size_t size,
+    unsigned char* out, size_t n);
+int compressBlocks(FILE* in, const struct MappedFile* map, const char* output_file, int64_t file_size,
+    size_t block_size);
+int decompressBlocksParallel(FILE* in, FILE* out, uint64_t block_size, uint64_t data_start, uint64_t* decoded);
+int decompressBlocks(FILE* in, FILE* out, uint64_t* decoded);
+void statDecompressed(FILE* in, uint64_t decoded);
+int64_t getFileSize(const char* filename);
+double getTimeSeconds(void);
+uint64_t getTimeNs(void);
+uint64_t stageTime(struct CodecStats* stats, int stage, uint64_t start);
+void statAdd(uint64_t* counter, uint64_t value);
+void progressBegin(const char* label, uint64_t total);
+void progressUpdate(uint64_t done);
+void progressAdvance(uint64_t n);
+void progressStart(void);
+void progressStop(void);
+int writeStatsJson(const char* path, const char* mode, int ok, double elapsed);
+void collectCodes(struct MinHeapNode* root, uint64_t code, int len, uint64_t codes[], int lens[]);
+int insertCode(struct DecodeTable* table, uint64_t code, int len, unsigned char symbol);
+int buildDecodeTable(struct DecodeTable* table, const uint64_t codes[], const int lens[]);
+void initBitWriter(struct BitWriter* bw, struct IoRing* ring, unsigned char* buffer);
+void encodeSymbols(const struct EncodeTable* table, struct BitWriter* bw, const unsigned char* in, size_t n);
+size_t finishBitWriter(struct BitWriter* bw);
+void flushBitWriter(struct BitWriter* bw, int final);
+void initBitReader(struct BitReader* br, struct IoRing* ring, unsigned char* buffer);
+void initBitReaderMemory(struct BitReader* br, const unsigned char* data, size_t size);
+void refillBitsSlow(struct BitReader* br);
+int decodeSymbols(const struct DecodeTable* table, struct BitReader* br, unsigned char* out, size_t n);
+int decodeStreams(const struct DecodeTable* table, struct BitReader br[], unsigned char* out[], size_t n);
+void buildAnsEncodeTable(struct AnsEncodeTable* table, const uint32_t norm[], int log);
+void buildAnsDecodeTable(struct AnsDecodeTable* table, const uint32_t norm[], int log);
+unsigned char* encodeAns(const struct AnsEncodeTable* table, const unsigned char* in, size_t n,
+    unsigned char* end, int* padding);
+void decodeAns(const struct AnsDecodeTable* table, struct BitReader* br, uint32_t state[], unsigned char* out,
+    size_t n);
+void encodeContextSymbols(const struct EncodeTable* const code[], struct BitWriter* bw, const unsigned char* in,
+    size_t n);
+int decodeContextStreams(const uint32_t* tables, const uint32_t* entry[], struct BitReader br[], unsigned char* out[],
+    size_t n);
+int selectKernels(const char* name);
 
 // Get file size using stat
-long getFileSize(const char* filename)
+int64_t getFileSize(const char* filename)
     {
     struct stat st;
     if (stat(filename, &st) == 0) {
@@ -53,36 +730,167 @@ long getFileSize(const char* filename)
     return -1;
     }
 
-// Allocate a new min heap node
-struct MinHeapNode* newNode(unsigned char data, unsigned freq)
+// Progress and summary messages, suppressed in batch mode
+void note(const char* format, ...)
     {
-    struct MinHeapNode* temp = (struct MinHeapNode*)malloc(sizeof(struct MinHeapNode));
-    if (temp == NULL) {
-        printf("ERROR: Memory allocation failed\n");
-        exit(1);
-        }
-    temp->left = temp->right = NULL;
-    temp->data = data;
-    temp->freq = freq;
-    return temp;
+    if (!verbose)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
     }
 
-// Create a min heap of given capacity
-struct MinHeap* createMinHeap(unsigned capacity)
+// Monotonic wall clock in seconds, used for throughput reporting
+double getTimeSeconds(void)
     {
-    struct MinHeap* minHeap = (struct MinHeap*)malloc(sizeof(struct MinHeap));
-    if (minHeap == NULL) {
-        printf("ERROR: Memory allocation failed\n");
-        exit(1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+// Monotonic clock in nanoseconds, used for stage times
+uint64_t getTimeNs(void)
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    }
+
+// Charge the time since start to a stage and return the current time, which
+// starts the next stage. Without stats the clock isn't read at all.
+uint64_t stageTime(struct CodecStats* stats, int stage, uint64_t start)
+    {
+    if (stats == NULL)
+        return 0;
+    uint64_t now = getTimeNs();
+    statAdd(&stats->ns[stage], now - start);
+    return now;
+    }
+
+// Add to a stats counter; block workers and batch jobs share one CodecStats
+void statAdd(uint64_t* counter, uint64_t value)
+    {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+    }
+
+// Start reporting a new operation of total bytes
+void progressBegin(const char* label, uint64_t total)
+    {
+    if (progressState.batch)
+        return;
+    __atomic_store_n(&progressState.label, label, __ATOMIC_RELAXED);
+    __atomic_store_n(&progressState.total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&progressState.done, 0, __ATOMIC_RELAXED);
+    }
+
+// Record how far the operation got. This is a plain store; the timer thread
+// does the arithmetic and the printing.
+void progressUpdate(uint64_t done)
+    {
+    if (progressState.batch)
+        return;
+    __atomic_store_n(&progressState.done, done, __ATOMIC_RELAXED);
+    }
+
+// Add n bytes to the progress of an operation whose parts finish out of order
+void progressAdvance(uint64_t n)
+    {
+    if (progressState.batch)
+        return;
+    __atomic_fetch_add(&progressState.done, n, __ATOMIC_RELAXED);
+    }
+
+// Timer thread: print the sampled progress until progressStop
+static void* progressThread(void* arg)
+    {
+    (void)arg;
+    int shown = -1;
+
+    pthread_mutex_lock(&progressState.lock);
+    while (!progressState.stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+            }
+        pthread_cond_timedwait(&progressState.changed, &progressState.lock, &ts);
+
+        const char* label = __atomic_load_n(&progressState.label, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&progressState.total, __ATOMIC_RELAXED);
+        uint64_t done = __atomic_load_n(&progressState.done, __ATOMIC_RELAXED);
+        if (label == NULL || total == 0)
+            continue;
+
+        int percent = done >= total ? 100 : (int)(done * 100 / total);
+        if (percent != shown) {
+            fprintf(stderr, "\r%s: %3d%%", label, percent);
+            fflush(stderr);
+            shown = percent;
+            }
         }
-    minHeap->size = 0;
-    minHeap->capacity = capacity;
-    minHeap->array = (struct MinHeapNode**)malloc(minHeap->capacity * sizeof(struct MinHeapNode*));
-    if (minHeap->array == NULL) {
-        printf("ERROR: Memory allocation failed\n");
-        exit(1);
+    pthread_mutex_unlock(&progressState.lock);
+
+    if (shown >= 0)
+        fprintf(stderr, "\n");
+    return NULL;
+    }
+
+// Start the progress timer thread (-p)
+void progressStart(void)
+    {
+    pthread_mutex_init(&progressState.lock, NULL);
+    pthread_cond_init(&progressState.changed, NULL);
+    progressState.stop = 0;
+    if (pthread_create(&progressState.thread, NULL, progressThread, NULL) != 0)
+        showProgress = 0;
+    }
+
+// Stop the progress timer thread and end its line
+void progressStop(void)
+    {
+    if (!showProgress)
+        return;
+    pthread_mutex_lock(&progressState.lock);
+    progressState.stop = 1;
+    pthread_cond_signal(&progressState.changed);
+    pthread_mutex_unlock(&progressState.lock);
+    pthread_join(progressState.thread, NULL);
+    }
+
+// Write the codec stats of a -c/-d run as one JSON object. Returns 0 if the
+// file can't be written.
+int writeStatsJson(const char* path, const char* mode, int ok, double elapsed)
+    {
+    FILE* json = fopen(path, "w");
+    if (json == NULL) {
+        printf("ERROR: Cannot write stats to %s\n", path);
+        return 0;
         }
-    return minHeap;
+
+    fprintf(json, "{\"mode\":\"%s\",\"ok\":%s,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+        "\"blocks\":%llu,\"tables_built\":%llu,\"histogram_ns\":%llu,\"match_ns\":%llu,\"tables_ns\":%llu,"
+        "\"coding_ns\":%llu,\"elapsed_ns\":%llu}\n",
+        mode, ok ? "true" : "false",
+        (unsigned long long)codecStats.bytes_in, (unsigned long long)codecStats.bytes_out,
+        (unsigned long long)codecStats.blocks, (unsigned long long)codecStats.tables_built,
+        (unsigned long long)codecStats.ns[STAGE_HISTOGRAM], (unsigned long long)codecStats.ns[STAGE_MATCH],
+        (unsigned long long)codecStats.ns[STAGE_TABLES],
+        (unsigned long long)codecStats.ns[STAGE_CODING], (unsigned long long)(elapsed * 1e9));
+    return fclose(json) == 0;
+    }
+
+// Take a new node from the arena
+struct MinHeapNode* newNode(struct HuffmanArena* arena, unsigned char data, uint64_t freq)
+    {
+    struct MinHeapNode* temp = &arena->node[arena->used++];
+    temp->left = temp->right = NULL;
+    temp->data = data;
+    temp->freq = freq;
+    return temp;
     }
 
 // Swap two min heap nodes
@@ -159,516 +967,6242 @@ int isLeaf(struct MinHeapNode* root)
     return !(root->left) && !(root->right);
     }
 
-// Creates a min heap and builds it
-struct MinHeap* createAndBuildMinHeap(unsigned char data[], int freq[], int size)
+// Fill a min heap with one leaf per character and build it
+void createAndBuildMinHeap(struct MinHeap* minHeap, struct HuffmanArena* arena, unsigned char data[],
+    uint64_t freq[], int size)
     {
-    printf("Creating min heap for %d characters...\n", size);
-
-    struct MinHeap* minHeap = createMinHeap(size);
-    if (!minHeap) {
-        printf("ERROR: Failed to create min heap\n");
-        exit(1);
-        }
-
-    for (int i = 0; i < size; ++i) {
-        minHeap->array[i] = newNode(data[i], freq[i]);
-        if (!minHeap->array[i]) {
-            printf("ERROR: Failed to create node for character %d\n", i);
-            exit(1);
-            }
-        }
+    for (int i = 0; i < size; ++i)
+        minHeap->array[i] = newNode(arena, data[i], freq[i]);
 
     minHeap->size = size;
-    printf("Building min heap...\n");
     buildMinHeap(minHeap);
-    printf("Min heap built successfully\n");
-
-    return minHeap;
     }
 
-// Build Huffman Tree and return root
-struct MinHeapNode* buildHuffmanTree(unsigned char data[], int freq[], int size)
+// Build Huffman Tree in the arena and return root. This is the heap-ordered
+// build of the original file format, whose decoder must rebuild exactly the
+// tree the encoder used; new formats get code lengths from buildCodeLengths.
+struct MinHeapNode* buildHuffmanTree(unsigned char data[], uint64_t freq[], int size, struct HuffmanArena* arena)
     {
-    printf("Building Huffman tree for %d characters...\n", size);
-
     struct MinHeapNode* left, * right, * top;
-    struct MinHeap* minHeap = createAndBuildMinHeap(data, freq, size);
+    struct MinHeap minHeap;
 
-    printf("Constructing Huffman tree by merging nodes...\n");
-    int nodes_merged = 0;
+    arena->used = 0;
+    createAndBuildMinHeap(&minHeap, arena, data, freq, size);
 
     // Step by step building of Huffman Tree
-    while (!isSizeOne(minHeap)) {
-        left = extractMin(minHeap);
-        right = extractMin(minHeap);
+    while (!isSizeOne(&minHeap)) {
+        left = extractMin(&minHeap);
+        right = extractMin(&minHeap);
 
         // Create a new internal node with '$' as data and frequency equal to sum of two nodes
-        top = newNode('$', left->freq + right->freq);
+        top = newNode(arena, '$', left->freq + right->freq);
         top->left = left;
         top->right = right;
-        insertMinHeap(minHeap, top);
-
-        nodes_merged++;
+        insertMinHeap(&minHeap, top);
         }
 
-    printf("Huffman tree completed with %d merges\n", nodes_merged);
-    return extractMin(minHeap);
+    return extractMin(&minHeap);
     }
 
-// Print huffman codes from the root of Huffman Tree
-void printCodes(struct MinHeapNode* root, int arr[], int top)
+// Optimal code lengths of at most max_len bits by package-merge. Weights must
+// be sorted in ascending order and 2^max_len must be at least n.
+void limitCodeLengths(const uint64_t weight[], int n, int max_len, int lens[])
     {
-    if (root->left) {
-        arr[top] = 0;
-        printCodes(root->left, arr, top + 1);
+    // Each level's list merges the leaves with the pairs ("packages") of the
+    // level below; only whether each position holds a leaf is kept
+    static const int LIST_SIZE = 2 * MAX_CHARS;
+    unsigned char is_leaf[MAX_CODE_LEN + 1][2 * MAX_CHARS];
+    uint64_t prev[2 * MAX_CHARS], cur[2 * MAX_CHARS];
+    int prev_len = n, cur_len;
+
+    for (int i = 0; i < n; i++) {
+        prev[i] = weight[i];
+        is_leaf[max_len][i] = 1;
+        lens[i] = 0;
         }
 
-    if (root->right) {
-        arr[top] = 1;
-        printCodes(root->right, arr, top + 1);
+    for (int level = max_len - 1; level >= 1; level--) {
+        int leaf = 0, pkg = 0, packages = prev_len / 2;
+        cur_len = 0;
+
+        while ((leaf < n || pkg < packages) && cur_len < LIST_SIZE) {
+            uint64_t pkg_weight = pkg < packages ? prev[2 * pkg] + prev[2 * pkg + 1] : 0;
+
+            if (pkg >= packages || (leaf < n && weight[leaf] <= pkg_weight)) {
+                cur[cur_len] = weight[leaf++];
+                is_leaf[level][cur_len++] = 1;
+                }
+            else {
+                cur[cur_len] = pkg_weight;
+                is_leaf[level][cur_len++] = 0;
+                pkg++;
+                }
+            }
+
+        memcpy(prev, cur, cur_len * sizeof(uint64_t));
+        prev_len = cur_len;
         }
 
-    if (isLeaf(root)) {
-        printf("%c: ", root->data);
-        for (int i = 0; i < top; ++i)
-            printf("%d", arr[i]);
-        printf("\n");
+    // The cheapest 2n - 2 items of the top list form the code. Every level a
+    // leaf is selected in adds one bit to its length; the leaves selected at a
+    // level are always the lightest ones.
+    int take = 2 * n - 2;
+    for (int level = 1; level <= max_len && take > 0; level++) {
+        int leaves = 0;
+        for (int i = 0; i < take; i++)
+            leaves += is_leaf[level][i];
+
+        for (int i = 0; i < leaves; i++)
+            lens[i]++;
+
+        take = 2 * (take - leaves);
         }
     }
 
-// Store huffman codes in an array for later use
-void storeCodes(struct MinHeapNode* root, int arr[], int top, char* huffmanCodes[])
+// Order symbols by ascending frequency, ties by position, for qsort
+static int compareSymbolWeight(const void* a, const void* b)
     {
-    if (root->left) {
-        arr[top] = 0;
-        storeCodes(root->left, arr, top + 1, huffmanCodes);
-        }
+    const struct SymbolWeight* x = (const struct SymbolWeight*)a;
+    const struct SymbolWeight* y = (const struct SymbolWeight*)b;
+    if (x->freq != y->freq)
+        return x->freq < y->freq ? -1 : 1;
+    return x->index - y->index;
+    }
 
-    if (root->right) {
-        arr[top] = 1;
-        storeCodes(root->right, arr, top + 1, huffmanCodes);
-        }
+// Huffman code lengths by the two-queue method: with the leaves sorted by
+// frequency, merged nodes are created in non-decreasing order, so the two
+// lightest nodes are always at the front of the leaf queue or the merged
+// queue. Node ids 0..n-1 are the sorted leaves and n..2n-2 the merged nodes in
+// creation order; a node's parent always has a higher id. depth[] receives
+// the code length of each sorted leaf.
+void huffmanDepths(const struct SymbolWeight sorted[], int n, int depth[])
+    {
+    uint64_t merged[MAX_CHARS];
+    int parent[MAX_TREE_NODES];
+    int node_depth[MAX_TREE_NODES];
+    int leaf = 0, front = 0;
 
-    if (isLeaf(root)) {
-        huffmanCodes[root->data] = (char*)malloc((top + 1) * sizeof(char));
-        if (huffmanCodes[root->data] == NULL) {
-            printf("ERROR: Memory allocation failed for huffman code storage\n");
-            exit(1);
+    for (int k = 0; k < n - 1; k++) {
+        int pick[2];
+        uint64_t sum = 0;
+
+        for (int j = 0; j < 2; j++) {
+            if (leaf < n && (front >= k || sorted[leaf].freq <= merged[front])) {
+                sum += sorted[leaf].freq;
+                pick[j] = leaf++;
+                }
+            else {
+                sum += merged[front];
+                pick[j] = n + front++;
+                }
             }
 
-        for (int i = 0; i < top; ++i)
-            huffmanCodes[root->data][i] = arr[i] + '0';
-        huffmanCodes[root->data][top] = '\0';
+        merged[k] = sum;
+        parent[pick[0]] = parent[pick[1]] = n + k;
         }
-    }
-
-// Generate Huffman codes
-void HuffmanCodes(unsigned char data[], int freq[], int size, char* huffmanCodes[])
-    {
-    printf("Generating Huffman codes...\n");
-    struct MinHeapNode* root = buildHuffmanTree(data, freq, size);
-    int arr[MAX_TREE_HT], top = 0;
 
-    printf("Storing codes for each character...\n");
-    storeCodes(root, arr, top, huffmanCodes);
-    printf("Huffman codes generated successfully\n");
+    node_depth[2 * n - 2] = 0;
+    for (int id = 2 * n - 3; id >= 0; id--)
+        node_depth[id] = node_depth[parent[id]] + 1;
+    for (int i = 0; i < n; i++)
+        depth[i] = node_depth[i];
     }
 
-// Count frequency of characters in a file using a buffer-based approach
-void countFrequency(FILE* file, int freq[], long* fileSize)
+// Derive code lengths from the symbol frequencies without building a tree or
+// allocating. When the code is deeper than max_len, package-merge finds the
+// best code within the limit instead. Sets how many bits the limit adds to
+// the encoded data.
+void buildCodeLengths(unsigned char data[], uint64_t freq[], int size, int max_len, int lens[],
+    uint64_t* limit_cost)
     {
-    // Clear all frequencies before starting
-    for (int i = 0; i < MAX_CHARS; i++) {
-        freq[i] = 0;
-        }
+    struct SymbolWeight sorted[MAX_CHARS];
+    int depth[MAX_CHARS];
+    int longest = 0;
 
-    // Get file size from filesystem (more reliable in Linux)
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
+    memset(lens, 0, MAX_CHARS * sizeof(int));
+    *limit_cost = 0;
 
-    if (file_size <= 0) {
-        printf("ERROR: File appears to be empty or invalid\n");
-        *fileSize = 0;
+    // A lone character still needs a one-bit code
+    if (size == 1) {
+        lens[data[0]] = 1;
         return;
         }
 
-    printf("File size is %ld bytes\n", file_size);
-    *fileSize = file_size;
+    for (int i = 0; i < size; i++) {
+        sorted[i].freq = freq[i];
+        sorted[i].index = i;
+        }
+    qsort(sorted, size, sizeof(sorted[0]), compareSymbolWeight);
 
-    // Use a buffer for more efficient reading
-    const int BUFFER_SIZE = 8192;  // 8KB buffer
-    unsigned char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    long total_read = 0;
-    int progress = 0;
+    huffmanDepths(sorted, size, depth);
+    for (int i = 0; i < size; i++) {
+        lens[data[sorted[i].index]] = depth[i];
+        if (depth[i] > longest)
+            longest = depth[i];
+        }
 
-    printf("Counting character frequencies...\n");
+    if (longest <= max_len)
+        return;
 
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        for (size_t i = 0; i < bytes_read; i++) {
-            freq[buffer[i]]++;
-            }
+    // n symbols need at least ceil(log2(n)) bits
+    while ((1 << max_len) < size)
+        max_len++;
 
-        total_read += bytes_read;
-        int new_progress = (total_read * 100) / file_size;
+    uint64_t weight[MAX_CHARS] = { 0 };
+    int limited[MAX_CHARS];
+    for (int i = 0; i < size; i++)
+        weight[i] = sorted[i].freq;
 
-        if (new_progress / 10 > progress / 10) {
-            progress = new_progress;
-            printf("Progress: %d%% complete\n", progress);
-            }
+    limitCodeLengths(weight, size, max_len, limited);
+
+    uint64_t optimal_bits = 0, limited_bits = 0;
+    for (int i = 0; i < size; i++) {
+        optimal_bits += sorted[i].freq * depth[i];
+        limited_bits += sorted[i].freq * limited[i];
+        lens[data[sorted[i].index]] = limited[i];
         }
 
-    printf("Finished counting frequencies\n");
-    rewind(file);
+    *limit_cost = limited_bits - optimal_bits;
     }
 
-// Validate file path
-int validatePath(const char* path, int isInputFile)
+// Assign canonical codes from code lengths (shorter codes first, ties broken by
+// byte value). Codes are returned bit-reversed so the first bit is in the LSB.
+void assignCanonicalCodes(const int lens[], uint64_t codes[])
     {
-    if (isInputFile) {
-        // For input file, check if it exists and is readable
-        if (access(path, R_OK) != 0) {
-            printf("Invalid path: Unable to read input file '%s'\n", path);
-            return 0;
-            }
+    int count[MAX_CODE_LEN + 1] = { 0 };
+    uint32_t next_code[MAX_CODE_LEN + 1];
+    uint32_t code = 0;
 
-        // Check if it's a regular file
-        struct stat path_stat;
-        stat(path, &path_stat);
-        if (!S_ISREG(path_stat.st_mode)) {
-            printf("Invalid path: '%s' is not a regular file\n", path);
-            return 0;
-            }
+    for (int i = 0; i < MAX_CHARS; i++)
+        count[lens[i]]++;
+    count[0] = 0;
 
-        // Check file size
-        long size = getFileSize(path);
-        if (size <= 0) {
-            printf("Warning: File '%s' appears to be empty\n", path);
-            }
-        else if (size > 100000000) { // 100MB
-            printf("Warning: File '%s' is very large (%ld bytes). This may take a while.\n", path, size);
-            }
+    for (int len = 1; len <= MAX_CODE_LEN; len++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
         }
-    else {
-        // For output file, check if directory is writable
-        char dir_path[MAX_PATH_LEN];
-        strcpy(dir_path, path);
 
-        // Find last slash to get directory path
-        char* last_slash = strrchr(dir_path, '/');
-        if (last_slash != NULL) {
-            *last_slash = '\0';  // Terminate string at last slash to get directory
-
-            // If no directory specified (just filename), use current directory
-            if (strlen(dir_path) == 0) {
-                strcpy(dir_path, ".");
-                }
-            }
-        else {
-            strcpy(dir_path, ".");  // No slash found, use current directory
-            }
+    for (int i = 0; i < MAX_CHARS; i++) {
+        codes[i] = 0;
+        if (lens[i] == 0)
+            continue;
 
-        // Check if directory is writable
-        if (access(dir_path, W_OK) != 0) {
-            printf("Invalid path: Unable to write to directory '%s'\n", dir_path);
-            return 0;
-            }
+        uint32_t c = next_code[lens[i]]++;
+        for (int j = 0; j < lens[i]; j++)
+            codes[i] |= (uint64_t)((c >> (lens[i] - 1 - j)) & 1) << j;
         }
-
-    printf("Path '%s' is valid\n", path);
-    return 1;
     }
 
-// Compress the input file and write to output file
-void compressFile(const char* input_file, const char* output_file)
+// Generate canonical Huffman codes
+void HuffmanCodes(unsigned char data[], uint64_t freq[], int size, int lens[], uint64_t codes[])
     {
-    FILE* in, * out;
-    int freq[MAX_CHARS] = { 0 };
-    unsigned char ch;
-    int i, j, len;
-    long fileSize = 0;
+    uint64_t limit_cost;
 
-    printf("Starting compression...\n");
-    printf("Opening input file: %s\n", input_file);
+    note("Generating Huffman codes...\n");
+    buildCodeLengths(data, freq, size, maxCodeLength, lens, &limit_cost);
+    assignCanonicalCodes(lens, codes);
 
-    // Check file size before opening
-    long file_size = getFileSize(input_file);
-    if (file_size <= 0) {
-        printf("ERROR: Input file is empty or cannot be read\n");
-        return;
-        }
-    else if (file_size > 100000000) { // 100MB
-        printf("Warning: File is large (%ld bytes). Compression may take some time.\n", file_size);
+    if (limit_cost > 0) {
+        uint64_t data_bits = 0;
+        for (int i = 0; i < size; i++)
+            data_bits += freq[i] * lens[data[i]];
+
+        note("Limiting codes to %d bits costs %llu bytes (%.3f%% larger data)\n", maxCodeLength,
+            (unsigned long long)((limit_cost + 7) / 8), limit_cost * 100.0 / (data_bits - limit_cost));
         }
+    note("Huffman codes generated successfully\n");
+    }
 
-    // Open input file
-    in = fopen(input_file, "rb");
-    if (in == NULL) {
-        printf("Error opening input file\n");
-        return;
+// Pack each code and its length into one word for the encode loop
+void buildEncodeTable(struct EncodeTable* table, const uint64_t codes[], const int lens[])
+    {
+    table->max_len = 0;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        table->entry[i] = (uint32_t)codes[i] | ((uint32_t)lens[i] << 16);
+        if (lens[i] > table->max_len)
+            table->max_len = lens[i];
         }
+    }
 
-    printf("Input file opened successfully\n");
+// Pack code lengths into the header, two 4-bit lengths per byte
+void writeCodeLengths(const int lens[], unsigned char packed[])
+    {
+    for (int i = 0; i < CODE_LENGTHS_SIZE; i++)
+        packed[i] = (unsigned char)(lens[2 * i] | (lens[2 * i + 1] << 4));
+    }
+
+// Unpack code lengths from the header. Returns 0 if no symbol has a code.
+int readCodeLengths(const unsigned char packed[], int lens[])
+    {
+    int used = 0;
+
+    for (int i = 0; i < CODE_LENGTHS_SIZE; i++) {
+        lens[2 * i] = packed[i] & 0x0F;
+        lens[2 * i + 1] = packed[i] >> 4;
+        used |= packed[i];
+        }
+
+    return used != 0;
+    }
+
+// Collect the code of every leaf in stream bit order (first bit in the LSB)
+void collectCodes(struct MinHeapNode* root, uint64_t code, int len, uint64_t codes[], int lens[])
+    {
+    if (isLeaf(root)) {
+        codes[root->data] = code;
+        lens[root->data] = len;
+        return;
+        }
+
+    if (root->left)
+        collectCodes(root->left, code, len + 1, codes, lens);
+    if (root->right)
+        collectCodes(root->right, code | ((uint64_t)1 << len), len + 1, codes, lens);
+    }
+
+// Add one code to the decode table, creating sub-tables for codes longer than
+// the root lookup. Returns 0 if the code collides with one already inserted.
+int insertCode(struct DecodeTable* table, uint64_t code, int len, unsigned char symbol)
+    {
+    unsigned base = 0;
+    int bits = DECODE_ROOT_BITS;
+
+    while (len > bits) {
+        uint32_t* entry = &table->entry[base + (code & ((1u << bits) - 1))];
+
+        if (!(*entry & ENTRY_LINK)) {
+            // A shorter code already owns this prefix
+            if (*entry != 0)
+                return 0;
+            if (table->used + (1u << DECODE_SUB_BITS) > DECODE_TABLE_SIZE)
+                return 0;
+
+            memset(&table->entry[table->used], 0, sizeof(uint32_t) << DECODE_SUB_BITS);
+            *entry = ENTRY_LINK | (table->used << 16) | (bits << 8);
+            table->used += 1u << DECODE_SUB_BITS;
+            }
+
+        base = ENTRY_OFFSET(*entry);
+        code >>= bits;
+        len -= bits;
+        bits = DECODE_SUB_BITS;
+        }
+
+    // Replicate the entry across every index that starts with this code
+    for (uint32_t i = (uint32_t)code; i < (1u << bits); i += 1u << len) {
+        if (table->entry[base + i] != 0)
+            return 0;
+        table->entry[base + i] = ((uint32_t)len << 8) | symbol;
+        }
+
+    return 1;
+    }
+
+// Build the lookup table from per-symbol codes; symbols with length 0 are absent
+int buildDecodeTable(struct DecodeTable* table, const uint64_t codes[], const int lens[])
+    {
+    memset(table->entry, 0, sizeof(uint32_t) << DECODE_ROOT_BITS);
+    table->used = 1u << DECODE_ROOT_BITS;
+    table->max_len = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (lens[i] > 0 && !insertCode(table, codes[i], lens[i], (unsigned char)i))
+            return 0;
+        if (lens[i] > table->max_len)
+            table->max_len = lens[i];
+        }
+
+    return 1;
+    }
+
+// Prepare a bit writer. With a NULL file the bytes stay in the buffer, which
+// must then have room for the whole output.
+void initBitWriter(struct BitWriter* bw, struct IoRing* ring, unsigned char* buffer)
+    {
+    bw->ring = ring;
+    bw->buffer = buffer;
+    bw->pos = buffer;
+    bw->bits = 0;
+    bw->count = 0;
+    bw->written = 0;
+    }
+
+// Store the accumulator with one unaligned 64-bit write and advance by the
+// whole bytes it held; the spare bits stay in the accumulator
+static inline void storeBits(unsigned char** pos, uint64_t* bits, int* count)
+    {
+    uint64_t v = *bits;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(*pos, &v, sizeof(v));
+    *pos += *count >> 3;
+    *bits >>= *count & ~7;
+    *count &= 7;
+    }
+
+// Encode n bytes into the output buffer, which needs room for two bytes per
+// symbol plus 8 bytes of slack. A store leaves at most 7 bits behind, so
+// codes of at most max_len bits fit 57 / max_len at a time between stores.
+static KERNEL_INLINE void encodeKernel(const struct EncodeTable* table, struct BitWriter* bw,
+    const unsigned char* in, size_t n, int max_len)
+    {
+    const uint32_t* entry = table->entry;
+    const int per_store = 57 / max_len;
+    unsigned char* pos = bw->pos;
+    uint64_t bits = bw->bits;
+    int count = bw->count;
+    size_t i = 0;
+
+    for (; i + per_store <= n; i += per_store) {
+        for (int k = 0; k < per_store; k++) {
+            uint32_t e = entry[in[i + k]];
+            bits |= (uint64_t)(e & 0xFFFF) << count;
+            count += e >> 16;
+            }
+        storeBits(&pos, &bits, &count);
+        }
+
+    for (; i < n; i++) {
+        uint32_t e = entry[in[i]];
+        bits |= (uint64_t)(e & 0xFFFF) << count;
+        count += e >> 16;
+        storeBits(&pos, &bits, &count);
+        }
+
+    bw->pos = pos;
+    bw->bits = bits;
+    bw->count = count;
+    }
+
+// Pad the last partial byte with zero bits; returns the bytes in the buffer
+size_t finishBitWriter(struct BitWriter* bw)
+    {
+    if (bw->count > 0) {
+        *bw->pos++ = (unsigned char)bw->bits;
+        bw->bits = 0;
+        bw->count = 0;
+        }
+
+    return bw->pos - bw->buffer;
+    }
+
+// Write the buffered bytes to the file. The final flush also pads and writes
+// the last partial byte.
+void flushBitWriter(struct BitWriter* bw, int final)
+    {
+    if (final)
+        finishBitWriter(bw);
+
+    size_t n = bw->pos - bw->buffer;
+    ioWrite(bw->ring, bw->buffer, n);
+    bw->written += n;
+    bw->pos = bw->buffer;
+    }
+
+// Prepare a bit reader that pulls IO_BUFFER_SIZE chunks from a file
+void initBitReader(struct BitReader* br, struct IoRing* ring, unsigned char* buffer)
+    {
+    br->ring = ring;
+    br->buffer = buffer;
+    br->pos = br->end = buffer;
+    br->bits = 0;
+    br->count = 0;
+    br->padding = 0;
+    }
+
+// Prepare a bit reader over data already in memory
+void initBitReaderMemory(struct BitReader* br, const unsigned char* data, size_t size)
+    {
+    br->ring = NULL;
+    br->buffer = NULL;
+    br->pos = data;
+    br->end = data + size;
+    br->bits = 0;
+    br->count = 0;
+    br->padding = 0;
+    }
+
+// Byte-wise refill used near the end of the buffer; reloads the buffer from
+// the file and pads with zero bytes once the input is exhausted
+void refillBitsSlow(struct BitReader* br)
+    {
+    while (br->count <= 56) {
+        if (br->pos == br->end) {
+            size_t got = 0;
+            if (br->ring != NULL) {
+                got = ioRead(br->ring, br->buffer, IO_BUFFER_SIZE);
+                br->pos = br->buffer;
+                br->end = br->buffer + got;
+                }
+
+            if (got == 0) {
+                br->count += 8;
+                br->padding++;
+                continue;
+                }
+            }
+
+        br->bits |= (uint64_t)*br->pos++ << br->count;
+        br->count += 8;
+        }
+    }
+
+// Top up the bit reader to at least 56 bits with a single unaligned 64-bit load
+static inline void refillBits(struct BitReader* br)
+    {
+    if (br->end - br->pos >= 8) {
+        uint64_t v;
+        memcpy(&v, br->pos, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        br->bits |= v << br->count;
+        br->pos += (63 - br->count) >> 3;
+        br->count |= 56;
+        }
+    else {
+        refillBitsSlow(br);
+        }
+    }
+
+// Append n bits (at most 32) to a bit writer
+static inline void writeBits(struct BitWriter* bw, uint32_t value, int n)
+    {
+    bw->bits |= (uint64_t)value << bw->count;
+    bw->count += n;
+    storeBits(&bw->pos, &bw->bits, &bw->count);
+    }
+
+// Read n bits (at most 32) written by writeBits
+static inline uint32_t readBits(struct BitReader* br, int n)
+    {
+    if (br->count < n)
+        refillBits(br);
+    uint32_t v = (uint32_t)(br->bits & ((1ull << n) - 1));
+    br->bits >>= n;
+    br->count -= n;
+    return v;
+    }
+
+// Resolve one symbol from the root table and drop its bits
+static inline unsigned char decodeRootSymbol(const uint32_t* entry, uint64_t* bits, int* count, int* invalid)
+    {
+    uint32_t e = entry[*bits & ((1u << DECODE_ROOT_BITS) - 1)];
+    *invalid |= e < 0x100u;
+    *bits >>= ENTRY_BITS(e);
+    *count -= ENTRY_BITS(e);
+    return (unsigned char)e;
+    }
+
+// Decode kernel for codes of at most max_len bits, which all fit the root
+// table: one lookup per symbol, and a refill leaves at least 56 bits, so one
+// refill per 56 / max_len symbols. Returns 0 if the stream holds an invalid code.
+static KERNEL_INLINE int decodeShortKernel(const struct DecodeTable* table, struct BitReader* br,
+    unsigned char* out, size_t n, int max_len)
+    {
+    const uint32_t* entry = table->entry;
+    const int per_refill = 56 / max_len;
+    uint64_t bits = br->bits;
+    int count = br->count;
+    int invalid = 0;
+    size_t i = 0;
+
+    for (; i + per_refill <= n; i += per_refill) {
+        if (count < per_refill * max_len) {
+            br->bits = bits;
+            br->count = count;
+            refillBits(br);
+            bits = br->bits;
+            count = br->count;
+            }
+
+        for (int k = 0; k < per_refill; k++)
+            out[i + k] = decodeRootSymbol(entry, &bits, &count, &invalid);
+        }
+
+    for (; i < n; i++) {
+        if (count < DECODE_ROOT_BITS) {
+            br->bits = bits;
+            br->count = count;
+            refillBits(br);
+            bits = br->bits;
+            count = br->count;
+            }
+
+        out[i] = decodeRootSymbol(entry, &bits, &count, &invalid);
+        }
+
+    br->bits = bits;
+    br->count = count;
+    return !invalid;
+    }
+
+// Decode kernel for codes longer than the root table, which follow its links
+// to sub-tables. Returns 0 if the stream holds an invalid code.
+static KERNEL_INLINE int decodeLinkedKernel(const struct DecodeTable* table, struct BitReader* br,
+    unsigned char* out, size_t n)
+    {
+    const uint32_t* entry = table->entry;
+    uint64_t bits = br->bits;
+    int count = br->count;
+
+    for (size_t i = 0; i < n; i++) {
+        if (count < 48) {
+            br->bits = bits;
+            br->count = count;
+            refillBits(br);
+            bits = br->bits;
+            count = br->count;
+            }
+
+        uint32_t e = entry[bits & ((1u << DECODE_ROOT_BITS) - 1)];
+
+        // Links to sub-tables and invalid entries both take the slow path
+        if (e - 0x100u >= ENTRY_LINK - 0x100u) {
+            while (e & ENTRY_LINK) {
+                bits >>= ENTRY_BITS(e);
+                count -= ENTRY_BITS(e);
+                e = entry[ENTRY_OFFSET(e) + (bits & ((1u << DECODE_SUB_BITS) - 1))];
+                }
+            if (e < 0x100u)
+                return 0;
+            }
+
+        bits >>= ENTRY_BITS(e);
+        count -= ENTRY_BITS(e);
+        out[i] = (unsigned char)e;
+        }
+
+    br->bits = bits;
+    br->count = count;
+    return 1;
+    }
+
+// Resolve one symbol through the root table and any sub-tables it links to,
+// and drop its bits. Invalid codes consume nothing and set *invalid.
+static inline unsigned char decodeLinkedSymbol(const uint32_t* entry, uint64_t* bits, int* count, int* invalid)
+    {
+    uint32_t e = entry[*bits & ((1u << DECODE_ROOT_BITS) - 1)];
+    while (e & ENTRY_LINK) {
+        *bits >>= ENTRY_BITS(e);
+        *count -= ENTRY_BITS(e);
+        e = entry[ENTRY_OFFSET(e) + (*bits & ((1u << DECODE_SUB_BITS) - 1))];
+        }
+    *invalid |= e < 0x100u;
+    *bits >>= ENTRY_BITS(e);
+    *count -= ENTRY_BITS(e);
+    return (unsigned char)e;
+    }
+
+// Refill a stream's bits held in locals once fewer than min bits remain
+static inline void refillStream(struct BitReader* br, uint64_t* bits, int* count, int min)
+    {
+    if (*count < min) {
+        br->bits = *bits;
+        br->count = *count;
+        refillBits(br);
+        *bits = br->bits;
+        *count = br->count;
+        }
+    }
+
+// Decode n symbols from each of STREAM_COUNT bit readers into out[s]. The
+// streams don't depend on each other, so their lookups overlap in the CPU
+// instead of each waiting for the previous code length. Tables of codes of
+// at most max_len <= DECODE_ROOT_BITS bits decode 56 / max_len symbols per
+// stream between refills. Returns 0 if any stream holds an invalid code.
+static KERNEL_INLINE int decodeStreamsKernel(const struct DecodeTable* table, struct BitReader br[],
+    unsigned char* out[], size_t n, int max_len)
+    {
+    const uint32_t* entry = table->entry;
+    unsigned char* out0 = out[0], * out1 = out[1], * out2 = out[2], * out3 = out[3];
+    uint64_t bits0 = br[0].bits, bits1 = br[1].bits, bits2 = br[2].bits, bits3 = br[3].bits;
+    int count0 = br[0].count, count1 = br[1].count, count2 = br[2].count, count3 = br[3].count;
+    int invalid = 0;
+    size_t i = 0;
+
+    if (max_len <= DECODE_ROOT_BITS) {
+        const int per_refill = 56 / max_len;
+
+        for (; i + per_refill <= n; i += per_refill) {
+            refillStream(&br[0], &bits0, &count0, per_refill * max_len);
+            refillStream(&br[1], &bits1, &count1, per_refill * max_len);
+            refillStream(&br[2], &bits2, &count2, per_refill * max_len);
+            refillStream(&br[3], &bits3, &count3, per_refill * max_len);
+
+            for (int k = 0; k < per_refill; k++) {
+                out0[i + k] = decodeRootSymbol(entry, &bits0, &count0, &invalid);
+                out1[i + k] = decodeRootSymbol(entry, &bits1, &count1, &invalid);
+                out2[i + k] = decodeRootSymbol(entry, &bits2, &count2, &invalid);
+                out3[i + k] = decodeRootSymbol(entry, &bits3, &count3, &invalid);
+                }
+            }
+        }
+    else {
+        // Three codes of up to MAX_CODE_LEN bits per stream and refill
+        for (; i + 3 <= n; i += 3) {
+            refillStream(&br[0], &bits0, &count0, 3 * MAX_CODE_LEN);
+            refillStream(&br[1], &bits1, &count1, 3 * MAX_CODE_LEN);
+            refillStream(&br[2], &bits2, &count2, 3 * MAX_CODE_LEN);
+            refillStream(&br[3], &bits3, &count3, 3 * MAX_CODE_LEN);
+
+            for (int k = 0; k < 3; k++) {
+                out0[i + k] = decodeLinkedSymbol(entry, &bits0, &count0, &invalid);
+                out1[i + k] = decodeLinkedSymbol(entry, &bits1, &count1, &invalid);
+                out2[i + k] = decodeLinkedSymbol(entry, &bits2, &count2, &invalid);
+                out3[i + k] = decodeLinkedSymbol(entry, &bits3, &count3, &invalid);
+                }
+            }
+        }
+
+    br[0].bits = bits0;
+    br[0].count = count0;
+    br[1].bits = bits1;
+    br[1].count = count1;
+    br[2].bits = bits2;
+    br[2].count = count2;
+    br[3].bits = bits3;
+    br[3].count = count3;
+    if (invalid)
+        return 0;
+
+    // The last few symbols of each stream
+    for (int s = 0; s < STREAM_COUNT; s++)
+        if (!decodeSymbols(table, &br[s], out[s] + i, n - i))
+            return 0;
+    return 1;
+    }
+
+// Add the byte counts of a buffer to freq. Four interleaved counter tables let
+// repeated bytes update different counters instead of waiting on one another;
+// the 32-bit tables are folded into freq every HISTOGRAM_SLICE bytes.
+void countBufferFrequency(const unsigned char* buffer, size_t n, uint64_t freq[])
+    {
+    if (n < HISTOGRAM_MIN_TABLES) {
+        for (size_t i = 0; i < n; i++)
+            freq[buffer[i]]++;
+        return;
+        }
+
+    uint32_t counts[HISTOGRAM_TABLES][MAX_CHARS];
+
+    while (n > 0) {
+        size_t slice = n < HISTOGRAM_SLICE ? n : HISTOGRAM_SLICE;
+        const unsigned char* p = buffer;
+        const unsigned char* end = buffer + slice;
+
+        memset(counts, 0, sizeof(counts));
+        while (end - p >= 16) {
+            uint64_t a, b;
+            memcpy(&a, p, 8);
+            memcpy(&b, p + 8, 8);
+            counts[0][a & 0xFF]++;
+            counts[1][(a >> 8) & 0xFF]++;
+            counts[2][(a >> 16) & 0xFF]++;
+            counts[3][(a >> 24) & 0xFF]++;
+            counts[0][(a >> 32) & 0xFF]++;
+            counts[1][(a >> 40) & 0xFF]++;
+            counts[2][(a >> 48) & 0xFF]++;
+            counts[3][a >> 56]++;
+            counts[0][b & 0xFF]++;
+            counts[1][(b >> 8) & 0xFF]++;
+            counts[2][(b >> 16) & 0xFF]++;
+            counts[3][(b >> 24) & 0xFF]++;
+            counts[0][(b >> 32) & 0xFF]++;
+            counts[1][(b >> 40) & 0xFF]++;
+            counts[2][(b >> 48) & 0xFF]++;
+            counts[3][b >> 56]++;
+            p += 16;
+            }
+        while (p < end)
+            counts[0][*p++]++;
+
+        for (int i = 0; i < MAX_CHARS; i++)
+            freq[i] += (uint64_t)counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+
+        buffer += slice;
+        n -= slice;
+        }
+    }
+
+// Count one slice of a parallel histogram
+void histogramTask(void* arg)
+    {
+    struct HistogramJob* job = (struct HistogramJob*)arg;
+    memset(job->freq, 0, sizeof(job->freq));
+    countBufferFrequency(job->data, job->size, job->freq);
+    }
+
+// Add the byte counts of a large buffer to freq, splitting it into one
+// contiguous slice per thread and summing the partial histograms
+int countFrequencyParallel(const unsigned char* data, size_t size, uint64_t freq[], int threads)
+    {
+    struct ThreadPool pool;
+    struct HistogramJob* jobs = (struct HistogramJob*)malloc(threads * sizeof(struct HistogramJob));
+    if (jobs == NULL || !poolInit(&pool, threads)) {
+        free(jobs);
+        return 0;
+        }
+
+    size_t slice = size / threads;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].data = data + t * slice;
+        jobs[t].size = t == threads - 1 ? size - t * slice : slice;
+        poolSubmit(&pool, histogramTask, &jobs[t]);
+        }
+    poolWait(&pool);
+    poolDestroy(&pool);
+
+    for (int t = 0; t < threads; t++)
+        for (int i = 0; i < MAX_CHARS; i++)
+            freq[i] += jobs[t].freq[i];
+
+    free(jobs);
+    return 1;
+    }
+
+// Count frequency of characters in a file using a buffer-based approach
+void countFrequency(FILE* file, uint64_t freq[], uint64_t* fileSize)
+    {
+    // Clear all frequencies before starting
+    for (int i = 0; i < MAX_CHARS; i++) {
+        freq[i] = 0;
+        }
+
+    // Get file size from filesystem (more reliable in Linux)
+    fseeko(file, 0, SEEK_END);
+    off_t file_size = ftello(file);
+    rewind(file);
+
+    if (file_size <= 0) {
+        printf("ERROR: File appears to be empty or invalid\n");
+        *fileSize = 0;
+        return;
+        }
+
+    note("File size is %llu bytes\n", (unsigned long long)file_size);
+    *fileSize = (uint64_t)file_size;
+
+    // Large reads keep the per-call cost of the counter tables negligible
+    unsigned char* buffer = (unsigned char*)malloc(IO_BUFFER_SIZE);
+    size_t bytes_read;
+    uint64_t total_read = 0;
+
+    if (buffer == NULL) {
+        printf("ERROR: Failed to allocate read buffer\n");
+        *fileSize = 0;
+        return;
+        }
+
+    note("Counting character frequencies...\n");
+    progressBegin("Counting", (uint64_t)file_size);
+
+    while ((bytes_read = fread(buffer, 1, IO_BUFFER_SIZE, file)) > 0) {
+        countBufferFrequency(buffer, bytes_read, freq);
+        total_read += bytes_read;
+        progressUpdate(total_read);
+        }
+
+    free(buffer);
+    note("Finished counting frequencies\n");
+    rewind(file);
+    }
+
+// Count frequency of characters in a mapped file
+void countMemoryFrequency(const unsigned char* data, size_t size, uint64_t freq[], uint64_t* fileSize)
+    {
+    memset(freq, 0, MAX_CHARS * sizeof(uint64_t));
+    *fileSize = size;
+
+    note("File size is %llu bytes\n", (unsigned long long)size);
+
+    if (numThreads > 1 && size >= PARALLEL_HISTOGRAM_MIN) {
+        note("Counting character frequencies with %d threads...\n", numThreads);
+        if (countFrequencyParallel(data, size, freq, numThreads)) {
+            note("Finished counting frequencies\n");
+            return;
+            }
+        memset(freq, 0, MAX_CHARS * sizeof(uint64_t));
+        }
+
+    note("Counting character frequencies...\n");
+    progressBegin("Counting", size);
+
+    for (size_t done = 0; done < size; ) {
+        size_t chunk = size - done < IO_BUFFER_SIZE ? size - done : IO_BUFFER_SIZE;
+        countBufferFrequency(data + done, chunk, freq);
+        done += chunk;
+        progressUpdate(done);
+        }
+
+    note("Finished counting frequencies\n");
+    }
+
+// Sampled histogram for single-pass compression: SAMPLE_CHUNKS evenly spaced
+// slices of the input, or all of it when that is smaller. Every byte value then
+// gets a count of at least one, so bytes the sample missed still have a code.
+// Unmapped files are sampled with pread, leaving the stream position at the
+// start. Returns the number of bytes sampled, or 0 if the input can't be read.
+uint64_t countSampleFrequency(FILE* file, const struct MappedFile* map, uint64_t size, uint64_t freq[])
+    {
+    unsigned char* buffer = map ? NULL : (unsigned char*)malloc(SAMPLE_CHUNK);
+    uint64_t chunks = SAMPLE_CHUNKS;
+    uint64_t chunk = SAMPLE_CHUNK;
+    uint64_t sampled = 0;
+
+    if (map == NULL && buffer == NULL)
+        return 0;
+
+    // Small inputs are counted whole
+    int whole = size <= chunks * chunk;
+    if (whole)
+        chunks = (size + chunk - 1) / chunk;
+
+    memset(freq, 0, MAX_CHARS * sizeof(uint64_t));
+    note("Sampling %llu slices of %llu bytes...\n", (unsigned long long)chunks, (unsigned long long)chunk);
+
+    for (uint64_t i = 0; i < chunks; i++) {
+        // Slices start at even steps, so the last one ends near the end of the input
+        uint64_t offset = whole ? i * chunk : i * ((size - chunk) / (chunks - 1));
+        size_t len = size - offset < chunk ? (size_t)(size - offset) : (size_t)chunk;
+
+        if (map != NULL) {
+            countBufferFrequency(map->data + offset, len, freq);
+            }
+        else {
+            ssize_t got = pread(fileno(file), buffer, len, (off_t)offset);
+            if (got <= 0)
+                break;
+            countBufferFrequency(buffer, (size_t)got, freq);
+            len = (size_t)got;
+            }
+        sampled += len;
+        }
+    free(buffer);
+
+    for (int i = 0; i < MAX_CHARS; i++)
+        freq[i]++;
+    return sampled;
+    }
+
+// Size in bits of data with the given histogram under the given code lengths
+uint64_t codedBits(const uint64_t freq[], const int lens[])
+    {
+    uint64_t bits = 0;
+    for (int i = 0; i < MAX_CHARS; i++)
+        bits += freq[i] * lens[i];
+    return bits;
+    }
+
+// Report what the sampled code table cost against one built from the exact
+// histogram, as a two-pass compression would
+void noteSampleCost(const uint64_t exact[], const int lens[])
+    {
+    unsigned char chars[MAX_CHARS];
+    uint64_t freq_list[MAX_CHARS];
+    int exact_lens[MAX_CHARS];
+    uint64_t limit_cost;
+    int size = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (exact[i] > 0) {
+            chars[size] = i;
+            freq_list[size] = exact[i];
+            size++;
+            }
+        }
+    if (size == 0)
+        return;
+
+    buildCodeLengths(chars, freq_list, size, maxCodeLength, exact_lens, &limit_cost);
+    uint64_t sampled_bits = codedBits(exact, lens);
+    uint64_t exact_bits = size > 1 ? codedBits(exact, exact_lens) : 0;
+    uint64_t lost = sampled_bits > exact_bits ? sampled_bits - exact_bits : 0;
+
+    note("Sampled code table costs %llu bytes (%.3f%% larger data) over an exact two-pass table\n",
+        (unsigned long long)((lost + 7) / 8), exact_bits > 0 ? lost * 100.0 / exact_bits : 0.0);
+    }
+
+// Validate file path
+int validatePath(const char* path, int isInputFile)
+    {
+    if (isInputFile) {
+        // For input file, check if it exists and is readable
+        if (access(path, R_OK) != 0) {
+            printf("Invalid path: Unable to read input file '%s'\n", path);
+            return 0;
+            }
+
+        // Check if it's a regular file
+        struct stat path_stat;
+        stat(path, &path_stat);
+        if (!S_ISREG(path_stat.st_mode)) {
+            printf("Invalid path: '%s' is not a regular file\n", path);
+            return 0;
+            }
+
+        // Check file size
+        if (getFileSize(path) <= 0) {
+            printf("Warning: File '%s' appears to be empty\n", path);
+            }
+        }
+    else {
+        // For output file, check if directory is writable
+        // Directory part of the path: everything before the last slash, "/"
+        // for files in the root, or the current directory without a slash
+        const char* last_slash = strrchr(path, '/');
+        char* dir_path;
+        if (last_slash == NULL)
+            dir_path = strdup(".");
+        else if (last_slash == path)
+            dir_path = strdup("/");
+        else
+            dir_path = strndup(path, (size_t)(last_slash - path));
+        if (dir_path == NULL) {
+            printf("ERROR: Memory allocation failed\n");
+            return 0;
+            }
+
+        // Check if directory is writable
+        if (access(dir_path, W_OK) != 0) {
+            printf("Invalid path: Unable to write to directory '%s'\n", dir_path);
+            free(dir_path);
+            return 0;
+            }
+        free(dir_path);
+        }
+
+    printf("Path '%s' is valid\n", path);
+    return 1;
+    }
+
+// Write a LEB128 varint (7 bits per byte, low group first); returns its length
+int writeVarint(unsigned char* out, uint64_t value)
+    {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+        }
+    out[n++] = (unsigned char)value;
+    return n;
+    }
+
+// Read a varint from the file. Returns 0 at end of file or on an overlong value.
+int readVarintFile(FILE* file, uint64_t* value)
+    {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF)
+            return 0;
+
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+        }
+    return 0;
+    }
+
+// Read a varint from memory, advancing pos. Returns 0 if it runs past end.
+int readVarint(const unsigned char** pos, const unsigned char* end, uint64_t* value)
+    {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        unsigned char c = *(*pos)++;
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+        }
+    return 0;
+    }
+
+// Store the block index and trailer that follow the end byte. out needs
+// INDEX_BOUND(count) bytes. Returns the bytes stored.
+size_t packBlockIndex(unsigned char* out, const struct BlockIndexEntry* index, uint64_t count, uint64_t index_offset)
+    {
+    size_t len = writeVarint(out, count);
+
+    for (uint64_t i = 0; i < count; i++) {
+        len += writeVarint(out + len, index[i].size);
+        len += writeVarint(out + len, index[i].original_size);
+        }
+
+    for (int i = 0; i < 8; i++)
+        out[len++] = (unsigned char)(index_offset >> (8 * i));
+    memcpy(out + len, INDEX_MAGIC, 4);
+    return len + 4;
+    }
+
+// Write the block index and trailer that follow the end byte. Returns the
+// bytes written; without memory for the index the file simply has none.
+int writeBlockIndex(struct IoRing* out, const struct BlockIndexEntry* index, uint64_t count, uint64_t index_offset)
+    {
+    unsigned char* buffer = (unsigned char*)malloc(INDEX_BOUND(count));
+    if (buffer == NULL)
+        return 0;
+
+    size_t len = packBlockIndex(buffer, index, count, index_offset);
+    ioWrite(out, buffer, len);
+    free(buffer);
+    return (int)len;
+    }
+
+// Parse the block index from the file's last bytes (index plus trailer) for a
+// file of file_size bytes whose blocks start at data_start. Returns NULL if
+// the file has no valid index.
+struct BlockIndexEntry* parseBlockIndex(const unsigned char* tail, size_t tail_size, uint64_t file_size,
+    uint64_t data_start, uint64_t* count)
+    {
+    if (tail_size < INDEX_TRAILER_SIZE)
+        return NULL;
+
+    const unsigned char* trailer = tail + tail_size - INDEX_TRAILER_SIZE;
+    uint64_t trailer_pos = file_size - INDEX_TRAILER_SIZE;
+    if (memcmp(trailer + 8, INDEX_MAGIC, 4) != 0)
+        return NULL;
+
+    uint64_t index_offset = 0;
+    for (int i = 0; i < 8; i++)
+        index_offset |= (uint64_t)trailer[i] << (8 * i);
+
+    // The index sits between the end byte and the trailer
+    if (index_offset <= data_start || index_offset >= trailer_pos ||
+        trailer_pos - index_offset > tail_size - INDEX_TRAILER_SIZE)
+        return NULL;
+
+    size_t index_size = (size_t)(trailer_pos - index_offset);
+    const unsigned char* pos = trailer - index_size;
+    const unsigned char* end = trailer;
+    struct BlockIndexEntry* index = NULL;
+    uint64_t n;
+
+    // Every entry takes at least two bytes, which bounds the allocation
+    if (readVarint(&pos, end, &n) && n <= index_size / 2)
+        index = (struct BlockIndexEntry*)malloc((n ? n : 1) * sizeof(struct BlockIndexEntry));
+
+    uint64_t offset = data_start, original_offset = 0, i = 0;
+    for (; index != NULL && i < n; i++) {
+        if (!readVarint(&pos, end, &index[i].size) || !readVarint(&pos, end, &index[i].original_size))
+            break;
+
+        index[i].offset = offset;
+        index[i].original_offset = original_offset;
+        offset += index[i].size;
+        original_offset += index[i].original_size;
+        }
+
+    // The records must exactly fill the space before the end byte
+    if (index == NULL || i < n || pos != end || offset + 1 != index_offset) {
+        free(index);
+        return NULL;
+        }
+
+    *count = n;
+    return index;
+    }
+
+// Load the block index of a seekable block-format file whose blocks start at
+// data_start. Returns NULL if the file has no valid index.
+struct BlockIndexEntry* readBlockIndex(FILE* in, uint64_t data_start, uint64_t* count)
+    {
+    unsigned char trailer[INDEX_TRAILER_SIZE];
+
+    if (fseeko(in, -INDEX_TRAILER_SIZE, SEEK_END) != 0)
+        return NULL;
+    off_t trailer_pos = ftello(in);
+    if (fread(trailer, 1, INDEX_TRAILER_SIZE, in) != INDEX_TRAILER_SIZE ||
+        memcmp(trailer + 8, INDEX_MAGIC, 4) != 0)
+        return NULL;
+
+    uint64_t index_offset = 0;
+    for (int i = 0; i < 8; i++)
+        index_offset |= (uint64_t)trailer[i] << (8 * i);
+    if (index_offset <= data_start || index_offset >= (uint64_t)trailer_pos)
+        return NULL;
+
+    // Read the index and trailer in one piece and parse them from memory
+    size_t tail_size = (size_t)(trailer_pos - index_offset) + INDEX_TRAILER_SIZE;
+    unsigned char* tail = (unsigned char*)malloc(tail_size);
+    struct BlockIndexEntry* index = NULL;
+
+    if (tail != NULL && fseeko(in, (off_t)index_offset, SEEK_SET) == 0 &&
+        fread(tail, 1, tail_size, in) == tail_size)
+        index = parseBlockIndex(tail, tail_size, trailer_pos + INDEX_TRAILER_SIZE, data_start, count);
+
+    free(tail);
+    return index;
+    }
+
+// Worker loop: run queued tasks until the pool is stopped and drained
+static void* poolWorker(void* arg)
+    {
+    struct ThreadPool* pool = (struct ThreadPool*)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->queued == 0 && !pool->stop)
+            pthread_cond_wait(&pool->task_ready, &pool->lock);
+        if (pool->queued == 0)
+            break;
+
+        void (*fn)(void*) = pool->task_fn[pool->head];
+        void* task_arg = pool->task_arg[pool->head];
+        pool->head = (pool->head + 1) % POOL_QUEUE_SIZE;
+        pool->queued--;
+        pool->running++;
+        pthread_cond_broadcast(&pool->task_done);
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(task_arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        pthread_cond_broadcast(&pool->task_done);
+        }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+    }
+
+// Start a pool of the given size. One thread or fewer means tasks run inline.
+int poolInit(struct ThreadPool* pool, int threads)
+    {
+    pool->num_threads = 0;
+    pool->head = pool->queued = pool->running = pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_ready, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+
+    if (threads <= 1)
+        return 1;
+
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, poolWorker, pool) != 0) {
+            poolDestroy(pool);
+            return 0;
+            }
+        pool->num_threads++;
+        }
+    return 1;
+    }
+
+// Queue a task, waiting while the queue is full
+void poolSubmit(struct ThreadPool* pool, void (*fn)(void*), void* arg)
+    {
+    if (pool->num_threads == 0) {
+        fn(arg);
+        return;
+        }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued == POOL_QUEUE_SIZE)
+        pthread_cond_wait(&pool->task_done, &pool->lock);
+
+    int slot = (pool->head + pool->queued) % POOL_QUEUE_SIZE;
+    pool->task_fn[slot] = fn;
+    pool->task_arg[slot] = arg;
+    pool->queued++;
+    pthread_cond_signal(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+    }
+
+// Wait until every submitted task has finished
+void poolWait(struct ThreadPool* pool)
+    {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued > 0 || pool->running > 0)
+        pthread_cond_wait(&pool->task_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    }
+
+// Finish queued tasks and stop the workers
+void poolDestroy(struct ThreadPool* pool)
+    {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->task_ready);
+    pthread_cond_destroy(&pool->task_done);
+    }
+
+// Reader side of an I/O ring: fill free buffers from the file until it ends.
+// Cancellation is only enabled inside fread, so a read blocked on a pipe can
+// be abandoned without leaving the ring locked.
+static void* ioReaderThread(void* arg)
+    {
+    struct IoRing* ring = (struct IoRing*)arg;
+    int state;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&ring->lock);
+    while (1) {
+        while (ring->full == ring->depth && !ring->stop)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        if (ring->stop)
+            break;
+        int slot = (ring->head + ring->full) % ring->depth;
+        pthread_mutex_unlock(&ring->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        size_t got = fread(ring->buffer[slot], 1, IO_BUFFER_SIZE, ring->file);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->length[slot] = got;
+        if (got > 0)
+            ring->full++;
+        if (got < IO_BUFFER_SIZE) {
+            ring->end = 1;
+            ring->error = ferror(ring->file);
+            }
+        pthread_cond_broadcast(&ring->changed);
+        if (ring->end)
+            break;
+        }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+    }
+
+// Writer side of an I/O ring: write full buffers in order until the caller
+// has finished and the ring is empty
+static void* ioWriterThread(void* arg)
+    {
+    struct IoRing* ring = (struct IoRing*)arg;
+
+    pthread_mutex_lock(&ring->lock);
+    while (1) {
+        while (ring->full == 0 && !ring->end)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        if (ring->full == 0)
+            break;
+        int slot = ring->head;
+        pthread_mutex_unlock(&ring->lock);
+
+        int failed = fwrite(ring->buffer[slot], 1, ring->length[slot], ring->file) != ring->length[slot];
+
+        pthread_mutex_lock(&ring->lock);
+        ring->error |= failed;
+        ring->head = (ring->head + 1) % ring->depth;
+        ring->full--;
+        pthread_cond_broadcast(&ring->changed);
+        }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+    }
+
+// Attach a ring of ioDepth buffers and a background thread to a file opened
+// for reading or writing. A depth of 0, or a failure to start, leaves plain
+// synchronous stdio calls.
+void ioStart(struct IoRing* ring, FILE* file, int writing)
+    {
+    ring->file = file;
+    ring->writing = writing;
+    ring->depth = 0;
+    ring->head = ring->full = 0;
+    ring->offset = 0;
+    ring->end = ring->stop = ring->error = 0;
+
+    if (ioDepth == 0)
+        return;
+
+    for (int i = 0; i < ioDepth; i++) {
+        ring->buffer[i] = (unsigned char*)malloc(IO_BUFFER_SIZE);
+        if (ring->buffer[i] == NULL) {
+            while (i > 0)
+                free(ring->buffer[--i]);
+            return;
+            }
+        }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    ring->depth = ioDepth;
+    if (pthread_create(&ring->thread, NULL, writing ? ioWriterThread : ioReaderThread, ring) != 0) {
+        pthread_mutex_destroy(&ring->lock);
+        pthread_cond_destroy(&ring->changed);
+        for (int i = 0; i < ring->depth; i++)
+            free(ring->buffer[i]);
+        ring->depth = 0;
+        }
+    }
+
+// Read up to n bytes, like fread
+size_t ioRead(struct IoRing* ring, void* dst, size_t n)
+    {
+    if (ring->depth == 0)
+        return fread(dst, 1, n, ring->file);
+
+    unsigned char* out = (unsigned char*)dst;
+    size_t done = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    while (done < n) {
+        while (ring->full == 0 && !ring->end)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        if (ring->full == 0)
+            break;
+
+        // The head buffer stays ours until it has been emptied
+        int slot = ring->head;
+        size_t take = ring->length[slot] - ring->offset;
+        if (take > n - done)
+            take = n - done;
+        pthread_mutex_unlock(&ring->lock);
+
+        memcpy(out + done, ring->buffer[slot] + ring->offset, take);
+        done += take;
+        ring->offset += take;
+
+        pthread_mutex_lock(&ring->lock);
+        if (ring->offset == ring->length[slot]) {
+            ring->offset = 0;
+            ring->head = (ring->head + 1) % ring->depth;
+            ring->full--;
+            pthread_cond_broadcast(&ring->changed);
+            }
+        }
+    pthread_mutex_unlock(&ring->lock);
+    return done;
+    }
+
+// Hand a filled buffer to the writer thread
+static void ioPublish(struct IoRing* ring)
+    {
+    pthread_mutex_lock(&ring->lock);
+    ring->length[(ring->head + ring->full) % ring->depth] = ring->offset;
+    ring->full++;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    ring->offset = 0;
+    }
+
+// Queue n bytes for writing, like fwrite. Errors are reported by ioFinish.
+void ioWrite(struct IoRing* ring, const void* src, size_t n)
+    {
+    if (ring->depth == 0) {
+        if (fwrite(src, 1, n, ring->file) != n)
+            ring->error = 1;
+        return;
+        }
+
+    const unsigned char* in = (const unsigned char*)src;
+    while (n > 0) {
+        // The next free buffer after the queued ones is filled in place
+        pthread_mutex_lock(&ring->lock);
+        while (ring->full == ring->depth)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        int slot = (ring->head + ring->full) % ring->depth;
+        pthread_mutex_unlock(&ring->lock);
+
+        size_t take = IO_BUFFER_SIZE - ring->offset;
+        if (take > n)
+            take = n;
+        memcpy(ring->buffer[slot] + ring->offset, in, take);
+        ring->offset += take;
+        in += take;
+        n -= take;
+
+        if (ring->offset == IO_BUFFER_SIZE)
+            ioPublish(ring);
+        }
+    }
+
+// Stop the ring's thread: a writer first writes everything queued, a reader
+// abandons what it read ahead. The file stays open. Returns 0 if a read or
+// write failed.
+int ioFinish(struct IoRing* ring)
+    {
+    if (ring->depth == 0)
+        return !ring->error && !ferror(ring->file);
+
+    if (ring->writing && ring->offset > 0) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->full == ring->depth)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+        ioPublish(ring);
+        }
+
+    pthread_mutex_lock(&ring->lock);
+    int blocked = !ring->writing && !ring->end;
+    ring->end = ring->stop = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+
+    // A reader may be waiting in fread for data that will never be used
+    if (blocked)
+        pthread_cancel(ring->thread);
+    pthread_join(ring->thread, NULL);
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+    for (int i = 0; i < ring->depth; i++)
+        free(ring->buffer[i]);
+    ring->depth = 0;
+    return !ring->error;
+    }
+
+// Replace a payload with the block's own bytes
+static size_t storeBlock(const unsigned char* in, size_t n, unsigned char* out, int* type, uint64_t* limit_cost)
+    {
+    *type = BLOCK_STORED;
+    *limit_cost = 0;
+    memcpy(out, in, n);
+    return n;
+    }
+
+// Base-2 logarithm of x > 0: the integer part from the highest set bit, then
+// 16 fraction bits by repeatedly squaring the mantissa
+static double log2Count(uint64_t x)
+    {
+    int e = 63 - __builtin_clzll(x);
+    double m = (double)x / (double)((uint64_t)1 << e);
+    double result = e;
+    double bit = 0.5;
+
+    for (int i = 0; i < 16; i++) {
+        m *= m;
+        if (m >= 2) {
+            m /= 2;
+            result += bit;
+            }
+        bit /= 2;
+        }
+    return result;
+    }
+
+// Base-2 logarithm of x > 0 to within 1e-5, for estimates that take many:
+// the exponent from the bits of the double, then a series for the mantissa
+static inline double fastLog2(double x)
+    {
+    uint64_t u;
+    double m;
+
+    memcpy(&u, &x, sizeof(u));
+    int e = (int)(u >> 52) - 1023;
+    u = (u & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+    memcpy(&m, &u, sizeof(m));
+
+    // ln(m) = 2 atanh(t) with t = (m - 1) / (m + 1) in [0, 1/3)
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    return e + 2.8853900817779268 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+    }
+
+// Shannon entropy of n bytes with the given histogram, in bits: the size no
+// per-byte code can beat
+double entropyBits(const uint64_t freq[], uint64_t n)
+    {
+    double log_n = log2Count(n);
+    double bits = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++)
+        if (freq[i] > 0)
+            bits += freq[i] * (log_n - log2Count(freq[i]));
+    return bits;
+    }
+
+// Entropy probe: whether coding n bytes can save at least 1 / MIN_CODED_GAIN
+// of them after paying for the code lengths
+int worthCoding(const uint64_t freq[], uint64_t n)
+    {
+    return entropyBits(freq, n) / 8 + CODE_LENGTHS_SIZE < n - n / MIN_CODED_GAIN;
+    }
+
+// tANS table log for n bytes: ANS_MAX_LOG, or less when the block is too
+// short to visit that many states
+static int ansTableLog(uint64_t n)
+    {
+    int log = ANS_MAX_LOG;
+    while (log > ANS_MIN_LOG && ((uint64_t)1 << (log - 1)) >= n)
+        log--;
+    return log;
+    }
+
+// Scale a histogram of n bytes to counts that add up to 2^log. Every byte
+// that occurs keeps a count of at least 1. The rounding error is settled one
+// count at a time where that costs the fewest bits: taking a count from byte
+// i costs about freq[i] / (norm[i] - 0.5) bits, giving one saves about
+// freq[i] / (norm[i] + 0.5).
+static void normalizeCounts(const uint64_t freq[], uint64_t n, int log, uint32_t norm[])
+    {
+    int64_t excess = -((int64_t)1 << log);
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        norm[i] = 0;
+        if (freq[i] > 0) {
+            norm[i] = (uint32_t)(((freq[i] << log) + n / 2) / n);
+            if (norm[i] == 0)
+                norm[i] = 1;
+            excess += norm[i];
+            }
+        }
+
+    for (; excess > 0; excess--) {
+        int best = -1;
+        double best_cost = 0;
+        for (int i = 0; i < MAX_CHARS; i++) {
+            double cost = (double)freq[i] / (norm[i] - 0.5);
+            if (norm[i] > 1 && (best < 0 || cost < best_cost)) {
+                best = i;
+                best_cost = cost;
+                }
+            }
+        norm[best]--;
+        }
+
+    for (; excess < 0; excess++) {
+        int best = -1;
+        double best_gain = 0;
+        for (int i = 0; i < MAX_CHARS; i++) {
+            double gain = (double)freq[i] / (norm[i] + 0.5);
+            if (norm[i] > 0 && (best < 0 || gain > best_gain)) {
+                best = i;
+                best_gain = gain;
+                }
+            }
+        norm[best]++;
+        }
+    }
+
+// Write the counts as exp-Golomb codes of count + 1: the position of its top
+// bit in unary (ones ended by a zero), then the bits below the top bit
+static void writeAnsCounts(struct BitWriter* bw, const uint32_t norm[])
+    {
+    for (int i = 0; i < MAX_CHARS; i++) {
+        uint32_t v = norm[i] + 1;
+        int top = 31 - __builtin_clz(v);
+        writeBits(bw, (1u << top) - 1, top + 1);
+        writeBits(bw, v & ((1u << top) - 1), top);
+        }
+    }
+
+// Read counts written by writeAnsCounts. Returns 0 unless they add up to 2^log.
+static int readAnsCounts(struct BitReader* br, int log, uint32_t norm[])
+    {
+    uint64_t total = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        int top = 0;
+        while (readBits(br, 1))
+            if (++top > log)
+                return 0;
+        norm[i] = ((1u << top) | readBits(br, top)) - 1;
+        total += norm[i];
+        }
+    return total == (uint64_t)1 << log;
+    }
+
+// Deal the 2^log states out to the byte values, norm[i] states each. The odd
+// step visits every state once and spaces out the states of each byte.
+static void spreadAnsStates(const uint32_t norm[], int log, unsigned char symbol[])
+    {
+    uint32_t size = 1u << log;
+    uint32_t step = size / 2 + size / 8 + 3;
+    uint32_t pos = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        for (uint32_t k = 0; k < norm[i]; k++) {
+            symbol[pos] = (unsigned char)i;
+            pos = (pos + step) & (size - 1);
+            }
+        }
+    }
+
+// Build the encoder tables of a set of counts. A byte with count c leaves a
+// state with max_bits or max_bits - 1 bits, whichever brings it down into
+// [c, 2c); delta_bits makes the top 16 bits of state + delta_bits that count.
+void buildAnsEncodeTable(struct AnsEncodeTable* table, const uint32_t norm[], int log)
+    {
+    unsigned char symbol[ANS_TABLE_SIZE];
+    uint32_t next[MAX_CHARS];
+    uint32_t size = 1u << log;
+    uint32_t total = 0;
+
+    spreadAnsStates(norm, log, symbol);
+    for (int i = 0; i < MAX_CHARS; i++) {
+        next[i] = total;
+        total += norm[i];
+        }
+    for (uint32_t u = 0; u < size; u++)
+        table->state[next[symbol[u]]++] = (uint16_t)(size + u);
+
+    total = 0;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        int max_bits = norm[i] > 1 ? log - (31 - __builtin_clz(norm[i] - 1)) : log;
+        table->delta_bits[i] = ((uint32_t)max_bits << 16) - (norm[i] << max_bits);
+        table->delta_state[i] = (int32_t)total - (int32_t)norm[i];
+        total += norm[i];
+        }
+    table->log = log;
+    }
+
+// Build the decoder table of a set of counts: the k-th state of a byte with
+// count c moves to state c + k after reading enough bits to land in [2^log,
+// 2^(log + 1)), less 2^log
+void buildAnsDecodeTable(struct AnsDecodeTable* table, const uint32_t norm[], int log)
+    {
+    unsigned char symbol[ANS_TABLE_SIZE];
+    uint32_t next[MAX_CHARS];
+    uint32_t size = 1u << log;
+
+    spreadAnsStates(norm, log, symbol);
+    memcpy(next, norm, sizeof(next));
+    for (uint32_t u = 0; u < size; u++) {
+        unsigned char c = symbol[u];
+        uint32_t x = next[c]++;
+        int bits = log - (31 - __builtin_clz(x));
+        table->entry[u] = ((x << bits) - size) | (uint32_t)c << 16 | (uint32_t)bits << 24;
+        }
+    }
+
+// Code one byte with a state: shift the state's low bits into the front of
+// the backwards accumulator, then look up the state that leads to it
+static inline void encodeAnsSymbol(const struct AnsEncodeTable* table, uint32_t* state, unsigned char c,
+    uint64_t* bits, int* count)
+    {
+    int n = (int)((*state + table->delta_bits[c]) >> 16);
+    *bits = (*bits << n) | (*state & ((1u << n) - 1));
+    *count += n;
+    *state = table->state[(*state >> n) + table->delta_state[c]];
+    }
+
+// Store the whole bytes of a backwards accumulator below pos with one
+// unaligned 64-bit write. Its highest bits were coded first and end up last.
+static inline void storeBitsBackward(unsigned char** pos, uint64_t* bits, int* count)
+    {
+    uint64_t v = *bits << (63 - *count) << 1;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(*pos - 8, &v, sizeof(v));
+    *pos -= *count >> 3;
+    *count &= 7;
+    *bits &= ((uint64_t)1 << *count) - 1;
+    }
+
+// Code n bytes from the last to the first into the buffer ending at end,
+// then the states. Writes may reach 8 bytes below the stream. Returns where
+// the stream starts and sets the padding bits in its first byte.
+static KERNEL_INLINE unsigned char* encodeAnsKernel(const struct AnsEncodeTable* table, const unsigned char* in,
+    size_t n, unsigned char* end, int* padding)
+    {
+    uint32_t state[ANS_STATES];
+    uint32_t size = 1u << table->log;
+    unsigned char* pos = end;
+    uint64_t bits = 0;
+    int count = 0;
+    size_t i = n;
+
+    for (int k = 0; k < ANS_STATES; k++)
+        state[k] = size;
+
+    for (; i % ANS_STATES != 0; i--) {
+        encodeAnsSymbol(table, &state[(i - 1) % ANS_STATES], in[i - 1], &bits, &count);
+        storeBitsBackward(&pos, &bits, &count);
+        }
+    uint32_t s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+    for (; i > 0; i -= ANS_STATES) {
+        encodeAnsSymbol(table, &s3, in[i - 1], &bits, &count);
+        encodeAnsSymbol(table, &s2, in[i - 2], &bits, &count);
+        encodeAnsSymbol(table, &s1, in[i - 3], &bits, &count);
+        encodeAnsSymbol(table, &s0, in[i - 4], &bits, &count);
+        storeBitsBackward(&pos, &bits, &count);
+        }
+    state[0] = s0;
+    state[1] = s1;
+    state[2] = s2;
+    state[3] = s3;
+
+    // The decoder starts from these states, first one first
+    for (int k = ANS_STATES - 1; k >= 0; k--) {
+        bits = (bits << table->log) | (state[k] - size);
+        count += table->log;
+        storeBitsBackward(&pos, &bits, &count);
+        }
+
+    *padding = 0;
+    if (count > 0) {
+        *padding = 8 - count;
+        *--pos = (unsigned char)(bits << *padding);
+        }
+    return pos;
+    }
+
+// Emit the byte of a state and move to the next state, adding the bits the
+// entry asks for to its base
+static inline unsigned char decodeAnsSymbol(const uint32_t* entry, uint32_t* state, uint64_t* bits, int* count)
+    {
+    uint32_t e = entry[*state];
+    int n = e >> 24;
+    *state = (e & 0xFFFF) + (uint32_t)(*bits & ((1u << n) - 1));
+    *bits >>= n;
+    *count -= n;
+    return (unsigned char)(e >> 16);
+    }
+
+// Decode kernel for tANS: the four states take turns, one lookup per byte
+// and no branches besides one refill per four bytes. The table only holds
+// valid states, so damaged input can give wrong bytes but never leaves it;
+// the caller checks the final states.
+static KERNEL_INLINE void decodeAnsKernel(const struct AnsDecodeTable* table, struct BitReader* br,
+    uint32_t state[], unsigned char* out, size_t n)
+    {
+    const uint32_t* entry = table->entry;
+    uint32_t s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+    size_t i = 0;
+
+    for (; i + ANS_STATES <= n; i += ANS_STATES) {
+        refillBits(br);
+        uint64_t bits = br->bits;
+        int count = br->count;
+
+        out[i] = decodeAnsSymbol(entry, &s0, &bits, &count);
+        out[i + 1] = decodeAnsSymbol(entry, &s1, &bits, &count);
+        out[i + 2] = decodeAnsSymbol(entry, &s2, &bits, &count);
+        out[i + 3] = decodeAnsSymbol(entry, &s3, &bits, &count);
+        br->bits = bits;
+        br->count = count;
+        }
+
+    state[0] = s0;
+    state[1] = s1;
+    state[2] = s2;
+    state[3] = s3;
+    for (; i < n; i++) {
+        refillBits(br);
+        out[i] = decodeAnsSymbol(entry, &state[i % ANS_STATES], &br->bits, &br->count);
+        }
+    }
+
+// Code n bytes as a BLOCK_ANS payload when its estimated size is below limit
+// bytes. out must hold BLOCK_BOUND(n) bytes; the stream is coded at its end
+// and moved behind the counts. Returns the payload size, or 0 to leave the
+// block to Huffman codes.
+static size_t codeAns(const struct CodecOptions* options, const unsigned char* in, size_t n,
+    const uint64_t freq[], unsigned char* out, size_t limit)
+    {
+    struct AnsEncodeTable table;
+    struct BitWriter bw;
+    uint32_t norm[MAX_CHARS];
+    struct CodecStats* stats = options->stats;
+    int log = ansTableLog(n);
+    uint64_t header_bits = 0;
+    double bits = ANS_STATES * log;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    normalizeCounts(freq, n, log, norm);
+    for (int i = 0; i < MAX_CHARS; i++) {
+        header_bits += 2 * (31 - __builtin_clz(norm[i] + 1)) + 1;
+        if (freq[i] > 0)
+            bits += freq[i] * (log - log2Count(norm[i]));
+        }
+
+    // A byte never takes more than log bits, so the worst case is known up front
+    size_t header = 1 + (size_t)((header_bits + 7) / 8);
+    size_t worst = (size_t)(((uint64_t)n + ANS_STATES) * log / 8) + 1;
+    if (header + (size_t)(bits / 8) + 1 >= limit || header + 8 + worst + 8 > BLOCK_BOUND(n)) {
+        stageTime(stats, STAGE_TABLES, start);
+        return 0;
+        }
+
+    buildAnsEncodeTable(&table, norm, log);
+    initBitWriter(&bw, NULL, out + 1);
+    writeAnsCounts(&bw, norm);
+    finishBitWriter(&bw);
+    if (stats != NULL)
+        statAdd(&stats->tables_built, 1);
+    start = stageTime(stats, STAGE_TABLES, start);
+
+    int padding;
+    unsigned char* end = out + BLOCK_BOUND(n);
+    unsigned char* stream = encodeAns(&table, in, n, end, &padding);
+    out[0] = (unsigned char)(log | padding << 4);
+    memmove(out + header, stream, end - stream);
+    stageTime(stats, STAGE_CODING, start);
+    return header + (end - stream);
+    }
+
+// Decode a BLOCK_ANS payload into n bytes. Returns 0 if the payload is corrupt.
+static int decodeAnsPayload(struct DecodeCache* cache, const unsigned char* in, size_t size, unsigned char* out,
+    size_t n)
+    {
+    struct CodecStats* stats = cache->stats;
+    struct BitReader br;
+    uint32_t norm[MAX_CHARS];
+    uint32_t state[ANS_STATES];
+
+    if (size < 1)
+        return 0;
+    int log = in[0] & 15;
+    int padding = in[0] >> 4;
+    if (log < ANS_MIN_LOG || log > ANS_MAX_LOG || padding > 7)
+        return 0;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    initBitReaderMemory(&br, in + 1, size - 1);
+    if (!readAnsCounts(&br, log, norm))
+        return 0;
+    buildAnsDecodeTable(&cache->ans, norm, log);
+    if (stats != NULL)
+        statAdd(&stats->tables_built, 1);
+    start = stageTime(stats, STAGE_TABLES, start);
+
+    // The stream starts at the byte after the last bit of the counts
+    uint64_t used = ((uint64_t)(br.pos - (in + 1)) + br.padding) * 8 - br.count;
+    used = (used + 7) / 8;
+    if (used > size - 1)
+        return 0;
+    initBitReaderMemory(&br, in + 1 + used, size - 1 - used);
+    readBits(&br, padding);
+    for (int k = 0; k < ANS_STATES; k++)
+        state[k] = readBits(&br, log);
+    decodeAns(&cache->ans, &br, state, out, n);
+    stageTime(stats, STAGE_CODING, start);
+
+    // Intact data brings every state back to where the encoder started and
+    // uses up the stream exactly
+    for (int k = 0; k < ANS_STATES; k++)
+        if (state[k] != 0)
+            return 0;
+    return br.pos == br.end && br.count == br.padding * 8;
+    }
+
+// Entropy-code n bytes with the given histogram. Blocks of one byte value
+// become BLOCK_SINGLE and blocks that don't compress BLOCK_STORED. The rest
+// become BLOCK_ANS when options->ans allows it and that comes out smaller,
+// or else a Huffman payload: packed code lengths, then the bitstream, or
+// with options->streams the jump table and four streams. out must hold
+// BLOCK_BOUND(n) bytes. Returns the payload size and sets the block type.
+static size_t codeBlock(const struct CodecOptions* options, const unsigned char* in, size_t n,
+    const uint64_t freq[], unsigned char* out, int* type, uint64_t* limit_cost)
+    {
+    uint64_t freq_list[MAX_CHARS];
+    int lens[MAX_CHARS];
+    unsigned char chars[MAX_CHARS];
+    uint64_t codes[MAX_CHARS];
+    struct EncodeTable table;
+    struct BitWriter bw;
+    struct CodecStats* stats = options->stats;
+    int size = 0;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (freq[i] > 0) {
+            chars[size] = i;
+            freq_list[size] = freq[i];
+            size++;
+            }
+        }
+
+    *limit_cost = 0;
+    if (size == 1) {
+        *type = BLOCK_SINGLE;
+        out[0] = chars[0];
+        return 1;
+        }
+    if (!worthCoding(freq, n))
+        return storeBlock(in, n, out, type, limit_cost);
+
+    buildCodeLengths(chars, freq_list, size, options->max_code_len, lens, limit_cost);
+    if (options->ans) {
+        int streams = options->streams && n >= MIN_STREAMS_BLOCK;
+        size_t huffman = CODE_LENGTHS_SIZE + (streams ? STREAM_JUMP_SIZE + STREAM_COUNT : 1) +
+            (size_t)(codedBits(freq, lens) / 8);
+        start = stageTime(stats, STAGE_TABLES, start);
+        size_t payload = codeAns(options, in, n, freq, out, huffman < n ? huffman : n);
+        if (payload > 0 && payload < n) {
+            *type = BLOCK_ANS;
+            *limit_cost = 0;
+            return payload;
+            }
+        if (payload > 0)
+            return storeBlock(in, n, out, type, limit_cost);
+        start = stats ? getTimeNs() : 0;
+        }
+    assignCanonicalCodes(lens, codes);
+    buildEncodeTable(&table, codes, lens);
+    writeCodeLengths(lens, out);
+    if (stats != NULL)
+        statAdd(&stats->tables_built, 1);
+    start = stageTime(stats, STAGE_TABLES, start);
+
+    if (!options->streams || n < MIN_STREAMS_BLOCK) {
+        *type = BLOCK_HUFFMAN;
+        initBitWriter(&bw, NULL, out + CODE_LENGTHS_SIZE);
+        encodeSymbols(&table, &bw, in, n);
+        size_t payload = CODE_LENGTHS_SIZE + finishBitWriter(&bw);
+        stageTime(stats, STAGE_CODING, start);
+        return payload < n ? payload : storeBlock(in, n, out, type, limit_cost);
+        }
+
+    // Each stream starts where the previous one ended; the 64-bit stores of
+    // one writer only spill into space the next stream overwrites
+    unsigned char* jump = out + CODE_LENGTHS_SIZE;
+    unsigned char* pos = jump + STREAM_JUMP_SIZE;
+    size_t quarter = n / STREAM_COUNT;
+
+    *type = BLOCK_HUFFMAN4;
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        size_t len = s < STREAM_COUNT - 1 ? quarter : n - s * quarter;
+        initBitWriter(&bw, NULL, pos);
+        encodeSymbols(&table, &bw, in + s * quarter, len);
+        size_t stream_size = finishBitWriter(&bw);
+
+        if (s < STREAM_COUNT - 1)
+            for (int i = 0; i < 4; i++)
+                jump[4 * s + i] = (unsigned char)(stream_size >> (8 * i));
+        pos += stream_size;
+        }
+    stageTime(stats, STAGE_CODING, start);
+
+    // The probe is a lower bound; a code that still came out larger than the
+    // block is replaced by the block itself
+    if ((size_t)(pos - out) >= n)
+        return storeBlock(in, n, out, type, limit_cost);
+    return pos - out;
+    }
+
+// Bits to code each byte value under a cluster's histogram, with every value
+// counted half a time more so bytes the cluster hasn't seen get a price
+static void clusterCosts(const uint64_t freq[], double cost[])
+    {
+    uint64_t n = 0;
+    for (int c = 0; c < MAX_CHARS; c++)
+        n += freq[c];
+
+    double log_n = fastLog2(n + MAX_CHARS / 2.0);
+    for (int c = 0; c < MAX_CHARS; c++)
+        cost[c] = log_n - fastLog2(freq[c] + 0.5);
+    }
+
+// Entropy of a histogram in bits
+static double histogramBits(const uint64_t freq[])
+    {
+    uint64_t n = 0;
+    double sum = 0;
+
+    for (int c = 0; c < MAX_CHARS; c++) {
+        if (freq[c] > 0) {
+            n += freq[c];
+            sum += freq[c] * fastLog2((double)freq[c]);
+            }
+        }
+    return n > 0 ? n * fastLog2((double)n) - sum : 0;
+    }
+
+// Bits to code the bytes that follow byte value x with the given costs
+static double contextBits(const struct ContextModel* m, int x, const double cost[])
+    {
+    double bits = 0;
+    for (uint32_t i = m->first[x]; i < m->first[x + 1]; i++)
+        bits += m->count[i] * cost[m->next[i]];
+    return bits;
+    }
+
+// Extra bits of coding clusters a and b with one code instead of two
+static double mergeBits(const struct ContextModel* m, int a, int b, const double bits[])
+    {
+    uint64_t merged[MAX_CHARS];
+    for (int c = 0; c < MAX_CHARS; c++)
+        merged[c] = m->cluster[a][c] + m->cluster[b][c];
+    return histogramBits(merged) - bits[a] - bits[b];
+    }
+
+// Group the byte values that precede others into at most CONTEXT_TABLES
+// clusters with similar histograms of the bytes after them. Seeds are the
+// busiest byte value, then each time the one the seeds so far code worst;
+// each round moves every byte value to the cluster that codes its followers
+// cheapest; finally clusters merge while that costs fewer bits than a table
+// of code lengths. Fills m->map and m->cluster; returns the cluster count.
+static int clusterContexts(struct ContextModel* m)
+    {
+    double cost[CONTEXT_TABLES][MAX_CHARS];
+    double worst[MAX_CHARS];
+    double bits[CONTEXT_TABLES];
+    double delta[CONTEXT_TABLES][CONTEXT_TABLES];
+    int active[MAX_CHARS];
+    int seeded[MAX_CHARS] = { 0 };
+    int contexts = 0, k = 0, seed = -1;
+
+    for (int x = 0; x < MAX_CHARS; x++) {
+        m->map[x] = 0;
+        if (m->total[x] > 0) {
+            if (seed < 0 || m->total[x] > m->total[seed])
+                seed = x;
+            worst[x] = 0;
+            active[contexts++] = x;
+            }
+        }
+
+    while (seed >= 0) {
+        for (int c = 0; c < MAX_CHARS; c++)
+            m->cluster[k][c] = m->pair[seed][c];
+        clusterCosts(m->cluster[k], cost[k]);
+        seeded[seed] = 1;
+        k++;
+
+        seed = -1;
+        if (k == CONTEXT_TABLES)
+            break;
+        for (int i = 0; i < contexts; i++) {
+            int x = active[i];
+            double b = contextBits(m, x, cost[k - 1]);
+            if (k == 1 || b < worst[x])
+                worst[x] = b;
+            if (!seeded[x] && (seed < 0 || worst[x] > worst[seed]))
+                seed = x;
+            }
+        }
+
+    for (int round = 0; round < CONTEXT_ROUNDS; round++) {
+        uint64_t size[CONTEXT_TABLES] = { 0 };
+        int renumber[CONTEXT_TABLES];
+        int used = 0;
+
+        memset(m->cluster, 0, sizeof(m->cluster[0]) * k);
+        for (int i = 0; i < contexts; i++) {
+            int x = active[i];
+            int best = 0;
+            double best_bits = contextBits(m, x, cost[0]);
+
+            for (int j = 1; j < k; j++) {
+                double b = contextBits(m, x, cost[j]);
+                if (b < best_bits) {
+                    best_bits = b;
+                    best = j;
+                    }
+                }
+            m->map[x] = best;
+            size[best] += m->total[x];
+            for (uint32_t e = m->first[x]; e < m->first[x + 1]; e++)
+                m->cluster[best][m->next[e]] += m->count[e];
+            }
+
+        // Clusters no byte value chose are dropped
+        for (int j = 0; j < k; j++) {
+            renumber[j] = used;
+            if (size[j] > 0) {
+                if (used != j)
+                    memcpy(m->cluster[used], m->cluster[j], sizeof(m->cluster[0]));
+                used++;
+                }
+            }
+        for (int i = 0; i < contexts; i++)
+            m->map[active[i]] = renumber[m->map[active[i]]];
+        k = used;
+        for (int j = 0; j < k; j++)
+            clusterCosts(m->cluster[j], cost[j]);
+        }
+
+    for (int j = 0; j < k; j++)
+        bits[j] = histogramBits(m->cluster[j]);
+    for (int a = 0; a < k; a++)
+        for (int b = a + 1; b < k; b++)
+            delta[a][b] = delta[b][a] = mergeBits(m, a, b, bits);
+
+    while (k > 1) {
+        int a = 0, b = 1;
+        for (int i = 0; i < k; i++)
+            for (int j = i + 1; j < k; j++)
+                if (delta[i][j] < delta[a][b]) {
+                    a = i;
+                    b = j;
+                    }
+        if (delta[a][b] >= CODE_LENGTHS_SIZE * 8)
+            break;
+
+        // Fold b into a and move the last cluster into b's place
+        k--;
+        for (int c = 0; c < MAX_CHARS; c++)
+            m->cluster[a][c] += m->cluster[b][c];
+        if (b != k) {
+            memcpy(m->cluster[b], m->cluster[k], sizeof(m->cluster[0]));
+            bits[b] = bits[k];
+            for (int j = 0; j < k; j++)
+                delta[b][j] = delta[j][b] = delta[k][j];
+            }
+        for (int i = 0; i < contexts; i++) {
+            int x = active[i];
+            if (m->map[x] == b)
+                m->map[x] = a;
+            else if (m->map[x] == k)
+                m->map[x] = b;
+            }
+
+        bits[a] = histogramBits(m->cluster[a]);
+        for (int j = 0; j < k; j++)
+            if (j != a)
+                delta[a][j] = delta[j][a] = mergeBits(m, a, j, bits);
+        }
+    return k;
+    }
+
+// Encode n bytes, each with the code of the byte before it (a zero before the
+// first). Codes are at most DECODE_ROOT_BITS long, so four fit between
+// stores of the accumulator.
+static KERNEL_INLINE void encodeContextKernel(const struct EncodeTable* const code[], struct BitWriter* bw,
+    const unsigned char* in, size_t n)
+    {
+    unsigned char* pos = bw->pos;
+    uint64_t bits = bw->bits;
+    int count = bw->count;
+    unsigned char prev = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        uint32_t e0 = code[prev]->entry[in[i]];
+        uint32_t e1 = code[in[i]]->entry[in[i + 1]];
+        uint32_t e2 = code[in[i + 1]]->entry[in[i + 2]];
+        uint32_t e3 = code[in[i + 2]]->entry[in[i + 3]];
+        prev = in[i + 3];
+
+        bits |= (uint64_t)(e0 & 0xFFFF) << count;
+        count += e0 >> 16;
+        bits |= (uint64_t)(e1 & 0xFFFF) << count;
+        count += e1 >> 16;
+        bits |= (uint64_t)(e2 & 0xFFFF) << count;
+        count += e2 >> 16;
+        bits |= (uint64_t)(e3 & 0xFFFF) << count;
+        count += e3 >> 16;
+        storeBits(&pos, &bits, &count);
+        }
+
+    for (; i < n; i++) {
+        uint32_t e = code[prev]->entry[in[i]];
+        prev = in[i];
+        bits |= (uint64_t)(e & 0xFFFF) << count;
+        count += e >> 16;
+        storeBits(&pos, &bits, &count);
+        }
+
+    bw->pos = pos;
+    bw->bits = bits;
+    bw->count = count;
+    }
+
+// Code n bytes as a BLOCK_CONTEXT payload when that comes out below limit
+// bytes. out must hold BLOCK_BOUND(n) bytes. Returns the payload size, or 0
+// to leave the block to order-0 codes.
+static size_t codeContext(const struct CodecOptions* options, const unsigned char* in, size_t n,
+    unsigned char* out, size_t limit, uint64_t* limit_cost)
+    {
+    struct CodecStats* stats = options->stats;
+    struct ContextModel* m = (struct ContextModel*)malloc(sizeof(struct ContextModel));
+    const struct EncodeTable* code[MAX_CHARS];
+    int lens[CONTEXT_TABLES][MAX_CHARS];
+    int max_len = options->max_code_len < DECODE_ROOT_BITS ? options->max_code_len : DECODE_ROOT_BITS;
+    uint64_t bits = 0;
+
+    if (m == NULL)
+        return 0;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    // Count each stream's first byte after a zero, as it is coded
+    size_t quarter = n / STREAM_COUNT;
+    memset(m->pair, 0, sizeof(m->pair));
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        size_t end = s < STREAM_COUNT - 1 ? (s + 1) * quarter : n;
+        unsigned char prev = 0;
+        for (size_t i = s * quarter; i < end; i++) {
+            m->pair[prev][in[i]]++;
+            prev = in[i];
+            }
+        }
+
+    uint32_t used = 0;
+    for (int x = 0; x < MAX_CHARS; x++) {
+        m->first[x] = used;
+        m->total[x] = 0;
+        for (int c = 0; c < MAX_CHARS; c++) {
+            if (m->pair[x][c] > 0) {
+                m->next[used] = (unsigned char)c;
+                m->count[used++] = m->pair[x][c];
+                m->total[x] += m->pair[x][c];
+                }
+            }
+        }
+    m->first[MAX_CHARS] = used;
+    start = stageTime(stats, STAGE_HISTOGRAM, start);
+
+    int k = clusterContexts(m);
+    *limit_cost = 0;
+    for (int j = 0; j < k; j++) {
+        uint64_t freq_list[MAX_CHARS];
+        unsigned char chars[MAX_CHARS];
+        uint64_t cost;
+        int size = 0;
+
+        for (int c = 0; c < MAX_CHARS; c++) {
+            if (m->cluster[j][c] > 0) {
+                chars[size] = (unsigned char)c;
+                freq_list[size++] = m->cluster[j][c];
+                }
+            }
+        buildCodeLengths(chars, freq_list, size, max_len, lens[j], &cost);
+        bits += codedBits(m->cluster[j], lens[j]);
+        *limit_cost += cost;
+        }
+
+    // One cluster is an order-0 code with a map on top
+    size_t header = 1 + CONTEXT_MAP_SIZE + (size_t)k * CODE_LENGTHS_SIZE;
+    size_t payload = header + STREAM_JUMP_SIZE + STREAM_COUNT + (size_t)(bits / 8);
+    if (k < 2 || payload >= limit) {
+        stageTime(stats, STAGE_TABLES, start);
+        free(m);
+        *limit_cost = 0;
+        return 0;
+        }
+
+    out[0] = (unsigned char)k;
+    writeCodeLengths(m->map, out + 1);
+    for (int j = 0; j < k; j++) {
+        uint64_t codes[MAX_CHARS];
+
+        writeCodeLengths(lens[j], out + 1 + CONTEXT_MAP_SIZE + j * CODE_LENGTHS_SIZE);
+        assignCanonicalCodes(lens[j], codes);
+        buildEncodeTable(&m->code[j], codes, lens[j]);
+        }
+    for (int x = 0; x < MAX_CHARS; x++)
+        code[x] = &m->code[m->map[x]];
+    if (stats != NULL)
+        statAdd(&stats->tables_built, k);
+    start = stageTime(stats, STAGE_TABLES, start);
+
+    // Each stream starts where the previous one ended, as in codeBlock
+    unsigned char* jump = out + header;
+    unsigned char* pos = jump + STREAM_JUMP_SIZE;
+
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        struct BitWriter bw;
+        size_t len = s < STREAM_COUNT - 1 ? quarter : n - s * quarter;
+
+        initBitWriter(&bw, NULL, pos);
+        encodeContextSymbols(code, &bw, in + s * quarter, len);
+        size_t stream_size = finishBitWriter(&bw);
+
+        if (s < STREAM_COUNT - 1)
+            for (int i = 0; i < 4; i++)
+                jump[4 * s + i] = (unsigned char)(stream_size >> (8 * i));
+        pos += stream_size;
+        }
+    stageTime(stats, STAGE_CODING, start);
+    free(m);
+    return pos - out;
+    }
+
+// Resolve one byte of a BLOCK_CONTEXT stream and move to the table of the
+// byte after it, which decode entries carry in bits 16-19
+static inline unsigned char decodeContextSymbol(const uint32_t* tables, const uint32_t** entry, uint64_t* bits,
+    int* count, int* invalid)
+    {
+    uint32_t e = (*entry)[*bits & ((1u << DECODE_ROOT_BITS) - 1)];
+    *invalid |= e < 0x100u;
+    *bits >>= ENTRY_BITS(e);
+    *count -= ENTRY_BITS(e);
+    *entry = tables + ((size_t)(e >> 16) << DECODE_ROOT_BITS);
+    return (unsigned char)e;
+    }
+
+// Decode n bytes of one BLOCK_CONTEXT stream, from the table at *entry.
+// Returns 0 if the stream holds an invalid code.
+static int decodeContextSymbols(const uint32_t* tables, const uint32_t** entry, struct BitReader* br,
+    unsigned char* out, size_t n)
+    {
+    uint64_t bits = br->bits;
+    int count = br->count;
+    int invalid = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        refillStream(br, &bits, &count, DECODE_ROOT_BITS);
+        out[i] = decodeContextSymbol(tables, entry, &bits, &count, &invalid);
+        }
+
+    br->bits = bits;
+    br->count = count;
+    return !invalid;
+    }
+
+// Decode n bytes from each of the STREAM_COUNT streams of a BLOCK_CONTEXT
+// payload in lockstep; each byte's lookup waits for the byte before it in
+// its own stream only. Returns 0 if any stream holds an invalid code.
+static KERNEL_INLINE int decodeContextKernel(const uint32_t* tables, const uint32_t* entry[],
+    struct BitReader br[], unsigned char* out[], size_t n)
+    {
+    const uint32_t* entry0 = entry[0], * entry1 = entry[1], * entry2 = entry[2], * entry3 = entry[3];
+    unsigned char* out0 = out[0], * out1 = out[1], * out2 = out[2], * out3 = out[3];
+    uint64_t bits0 = br[0].bits, bits1 = br[1].bits, bits2 = br[2].bits, bits3 = br[3].bits;
+    int count0 = br[0].count, count1 = br[1].count, count2 = br[2].count, count3 = br[3].count;
+    int invalid = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        refillStream(&br[0], &bits0, &count0, 4 * DECODE_ROOT_BITS);
+        refillStream(&br[1], &bits1, &count1, 4 * DECODE_ROOT_BITS);
+        refillStream(&br[2], &bits2, &count2, 4 * DECODE_ROOT_BITS);
+        refillStream(&br[3], &bits3, &count3, 4 * DECODE_ROOT_BITS);
+
+        for (int k = 0; k < 4; k++) {
+            out0[i + k] = decodeContextSymbol(tables, &entry0, &bits0, &count0, &invalid);
+            out1[i + k] = decodeContextSymbol(tables, &entry1, &bits1, &count1, &invalid);
+            out2[i + k] = decodeContextSymbol(tables, &entry2, &bits2, &count2, &invalid);
+            out3[i + k] = decodeContextSymbol(tables, &entry3, &bits3, &count3, &invalid);
+            }
+        }
+
+    br[0].bits = bits0;
+    br[0].count = count0;
+    br[1].bits = bits1;
+    br[1].count = count1;
+    br[2].bits = bits2;
+    br[2].count = count2;
+    br[3].bits = bits3;
+    br[3].count = count3;
+    entry[0] = entry0;
+    entry[1] = entry1;
+    entry[2] = entry2;
+    entry[3] = entry3;
+    if (invalid)
+        return 0;
+
+    // The last few bytes of each stream
+    for (int s = 0; s < STREAM_COUNT; s++)
+        if (!decodeContextSymbols(tables, &entry[s], &br[s], out[s] + i, n - i))
+            return 0;
+    return 1;
+    }
+
+// Decode a BLOCK_CONTEXT payload into n bytes. Returns 0 if the payload is
+// corrupt.
+static int decodeContextPayload(struct DecodeCache* cache, const unsigned char* in, size_t size,
+    unsigned char* out, size_t n)
+    {
+    struct CodecStats* stats = cache->stats;
+    struct BitReader br[STREAM_COUNT];
+    const uint32_t* entry[STREAM_COUNT];
+    unsigned char* stream_out[STREAM_COUNT];
+    int map[MAX_CHARS];
+    int k = size > 0 ? in[0] : 0;
+    size_t header = 1 + CONTEXT_MAP_SIZE + (size_t)k * CODE_LENGTHS_SIZE;
+
+    if (k < 1 || k > CONTEXT_TABLES || size < header + STREAM_JUMP_SIZE)
+        return 0;
+    readCodeLengths(in + 1, map);
+    for (int x = 0; x < MAX_CHARS; x++)
+        if (map[x] >= k)
+            return 0;
+
+    // Each code is built in the cache's table, then its root table is copied
+    // with the table of every byte's successor added to the entries
+    uint64_t start = stats ? getTimeNs() : 0;
+    cache->valid = 0;
+    for (int j = 0; j < k; j++) {
+        int lens[MAX_CHARS];
+        uint64_t codes[MAX_CHARS];
+        uint32_t* table = cache->context + ((size_t)j << DECODE_ROOT_BITS);
+
+        if (!readCodeLengths(in + 1 + CONTEXT_MAP_SIZE + j * CODE_LENGTHS_SIZE, lens))
+            return 0;
+        assignCanonicalCodes(lens, codes);
+        if (!buildDecodeTable(&cache->table, codes, lens) || cache->table.max_len > DECODE_ROOT_BITS)
+            return 0;
+        for (int i = 0; i < (1 << DECODE_ROOT_BITS); i++) {
+            uint32_t e = cache->table.entry[i];
+            table[i] = e < 0x100u ? e : e | (uint32_t)map[e & 0xFF] << 16;
+            }
+        }
+    if (stats != NULL)
+        statAdd(&stats->tables_built, k);
+    start = stageTime(stats, STAGE_TABLES, start);
+
+    // Locate the streams through the jump table
+    const unsigned char* jump = in + header;
+    const unsigned char* pos = jump + STREAM_JUMP_SIZE;
+    const unsigned char* end = in + size;
+    size_t quarter = n / STREAM_COUNT;
+
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        size_t stream_size = end - pos;
+        if (s < STREAM_COUNT - 1) {
+            stream_size = 0;
+            for (int i = 0; i < 4; i++)
+                stream_size |= (size_t)jump[4 * s + i] << (8 * i);
+            if (stream_size > (size_t)(end - pos))
+                return 0;
+            }
+
+        initBitReaderMemory(&br[s], pos, stream_size);
+        entry[s] = cache->context + ((size_t)map[0] << DECODE_ROOT_BITS);
+        stream_out[s] = out + s * quarter;
+        pos += stream_size;
+        }
+
+    int ok = decodeContextStreams(cache->context, entry, br, stream_out, quarter) &&
+        decodeContextSymbols(cache->context, &entry[STREAM_COUNT - 1], &br[STREAM_COUNT - 1],
+            stream_out[STREAM_COUNT - 1] + quarter, n - STREAM_COUNT * quarter);
+    stageTime(stats, STAGE_CODING, start);
+    if (!ok)
+        return 0;
+
+    // Bits taken from the zero padding mean a stream was cut short
+    for (int s = 0; s < STREAM_COUNT; s++)
+        if (br[s].padding * 8 > br[s].count)
+            return 0;
+    return 1;
+    }
+
+// Instantiate every kernel for one instruction set. The bodies above are
+// forced inline, so each copy is compiled with the set's instructions, and
+// the longest code of a table picks a copy of the loop unrolled to match.
+#define DEFINE_KERNELS(set, label, target, supported) \
+    target static void encode##set(const struct EncodeTable* table, struct BitWriter* bw, \
+        const unsigned char* in, size_t n) \
+        { \
+        if (table->max_len <= 8) \
+            encodeKernel(table, bw, in, n, 8); \
+        else if (table->max_len <= DECODE_ROOT_BITS) \
+            encodeKernel(table, bw, in, n, DECODE_ROOT_BITS); \
+        else \
+            encodeKernel(table, bw, in, n, MAX_CODE_LEN); \
+        } \
+    target static int decode##set(const struct DecodeTable* table, struct BitReader* br, unsigned char* out, \
+        size_t n) \
+        { \
+        if (table->max_len <= 8) \
+            return decodeShortKernel(table, br, out, n, 8); \
+        if (table->max_len <= DECODE_ROOT_BITS) \
+            return decodeShortKernel(table, br, out, n, DECODE_ROOT_BITS); \
+        return decodeLinkedKernel(table, br, out, n); \
+        } \
+    target static int decodeStreams##set(const struct DecodeTable* table, struct BitReader br[], \
+        unsigned char* out[], size_t n) \
+        { \
+        if (table->max_len <= 8) \
+            return decodeStreamsKernel(table, br, out, n, 8); \
+        if (table->max_len <= DECODE_ROOT_BITS) \
+            return decodeStreamsKernel(table, br, out, n, DECODE_ROOT_BITS); \
+        return decodeStreamsKernel(table, br, out, n, MAX_CODE_LEN); \
+        } \
+    target static unsigned char* encodeAns##set(const struct AnsEncodeTable* table, const unsigned char* in, \
+        size_t n, unsigned char* end, int* padding) \
+        { \
+        return encodeAnsKernel(table, in, n, end, padding); \
+        } \
+    target static void decodeAns##set(const struct AnsDecodeTable* table, struct BitReader* br, \
+        uint32_t state[], unsigned char* out, size_t n) \
+        { \
+        decodeAnsKernel(table, br, state, out, n); \
+        } \
+    target static void encodeContext##set(const struct EncodeTable* const code[], struct BitWriter* bw, \
+        const unsigned char* in, size_t n) \
+        { \
+        encodeContextKernel(code, bw, in, n); \
+        } \
+    target static int decodeContext##set(const uint32_t* tables, const uint32_t* entry[], struct BitReader br[], \
+        unsigned char* out[], size_t n) \
+        { \
+        return decodeContextKernel(tables, entry, br, out, n); \
+        } \
+    static const struct CodecKernels set##Kernels = { label, supported, encode##set, decode##set, \
+        decodeStreams##set, encodeAns##set, decodeAns##set, encodeContext##set, decodeContext##set };
+
+DEFINE_KERNELS(generic, "generic", , NULL)
+
+#if KERNEL_TARGETS
+static int cpuHasBmi2(void)
+    {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+    }
+
+DEFINE_KERNELS(bmi2, "bmi2", __attribute__((target("bmi,bmi2"))), cpuHasBmi2)
+#endif
+
+// Kernel sets, best first
+static const struct CodecKernels* const kernelSets[] = {
+#if KERNEL_TARGETS
+    &bmi2Kernels,
+#endif
+    &genericKernels,
+    };
+
+static const struct CodecKernels* kernels = &genericKernels;
+
+// Use the named kernel set, or with NULL the best one the CPU supports.
+// Returns 0 if there is no such set or the CPU lacks its instructions.
+int selectKernels(const char* name)
+    {
+    for (size_t i = 0; i < sizeof(kernelSets) / sizeof(kernelSets[0]); i++) {
+        const struct CodecKernels* set = kernelSets[i];
+        if (name != NULL && strcmp(name, set->name) != 0)
+            continue;
+        if (set->supported == NULL || set->supported()) {
+            kernels = set;
+            return 1;
+            }
+        if (name != NULL)
+            return 0;
+        }
+    return 0;
+    }
+
+// Pick the kernels before main or the first library call
+__attribute__((constructor)) static void initKernels(void)
+    {
+    selectKernels(NULL);
+    }
+
+// Encode n bytes with the kernels in use; see encodeKernel
+void encodeSymbols(const struct EncodeTable* table, struct BitWriter* bw, const unsigned char* in, size_t n)
+    {
+    kernels->encode(table, bw, in, n);
+    }
+
+// Decode n symbols into out. Returns 0 if the stream holds an invalid code.
+int decodeSymbols(const struct DecodeTable* table, struct BitReader* br, unsigned char* out, size_t n)
+    {
+    return kernels->decode(table, br, out, n);
+    }
+
+// Decode n symbols from each of STREAM_COUNT streams; see decodeStreamsKernel
+int decodeStreams(const struct DecodeTable* table, struct BitReader br[], unsigned char* out[], size_t n)
+    {
+    return kernels->decodeStreams(table, br, out, n);
+    }
+
+// tANS-code n bytes backwards into the buffer ending at end; see encodeAnsKernel
+unsigned char* encodeAns(const struct AnsEncodeTable* table, const unsigned char* in, size_t n,
+    unsigned char* end, int* padding)
+    {
+    return kernels->encodeAns(table, in, n, end, padding);
+    }
+
+// Decode n tANS-coded bytes; see decodeAnsKernel
+void decodeAns(const struct AnsDecodeTable* table, struct BitReader* br, uint32_t state[], unsigned char* out,
+    size_t n)
+    {
+    kernels->decodeAns(table, br, state, out, n);
+    }
+
+// Encode one stream of a BLOCK_CONTEXT payload; see encodeContextKernel
+void encodeContextSymbols(const struct EncodeTable* const code[], struct BitWriter* bw, const unsigned char* in,
+    size_t n)
+    {
+    kernels->encodeContext(code, bw, in, n);
+    }
+
+// Decode the streams of a BLOCK_CONTEXT payload; see decodeContextKernel
+int decodeContextStreams(const uint32_t* tables, const uint32_t* entry[], struct BitReader br[], unsigned char* out[],
+    size_t n)
+    {
+    return kernels->decodeContext(tables, entry, br, out, n);
+    }
+
+// Match finder settings of each -z level
+static const struct LzLevel lzLevels[LZ_MAX_LEVEL + 1] = {
+    { 0, 0, 0 },
+    { 0, 0, 32 },
+    { 2, 0, 16 },
+    { 4, 0, 32 },
+    { 8, 0, 48 },
+    { 16, 1, 64 },
+    { 32, 1, 96 },
+    { 64, 1, 128 },
+    { 128, 1, 256 },
+    { 256, 1, 512 },
+    };
+
+// Hash of the LZ_HASH_BYTES bytes at p
+static inline uint32_t lzHash(const unsigned char* p, int bits)
+    {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return (uint32_t)(((v << (64 - 8 * LZ_HASH_BYTES)) * 0xCF1BBCDCB7A56463ull) >> (64 - bits));
+    }
+
+// Length of the common prefix of a and b, up to limit bytes
+static inline size_t matchLength(const unsigned char* a, const unsigned char* b, size_t limit)
+    {
+    size_t len = 0;
+
+    while (len + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + len, sizeof(x));
+        memcpy(&y, b + len, sizeof(y));
+        if (x != y) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return len + (__builtin_clzll(x ^ y) >> 3);
+#else
+            return len + (__builtin_ctzll(x ^ y) >> 3);
+#endif
+            }
+        len += 8;
+        }
+    while (len < limit && a[len] == b[len])
+        len++;
+    return len;
+    }
+
+// Code byte of a length or distance value, with the extra bits that follow it
+static inline unsigned char lzValueCode(uint32_t v, uint32_t* extra, int* extra_bits)
+    {
+    if (v < LZ_DIRECT_CODES) {
+        *extra = 0;
+        *extra_bits = 0;
+        return (unsigned char)v;
+        }
+
+    int top = 31 - __builtin_clz(v);
+    *extra_bits = top - 2;
+    *extra = v & ((1u << (top - 2)) - 1);
+    return (unsigned char)(LZ_DIRECT_CODES + 4 * (top - 4) + ((v >> (top - 2)) & 3));
+    }
+
+// Value of a length or distance code, reading its extra bits. Returns 0 for
+// codes of values that don't fit 31 bits.
+static inline int lzValue(unsigned char code, struct BitReader* br, uint32_t* v)
+    {
+    if (code < LZ_DIRECT_CODES) {
+        *v = code;
+        return 1;
+        }
+
+    int top = (code - LZ_DIRECT_CODES) / 4 + 4;
+    if (top > 30)
+        return 0;
+    *v = ((4u | ((code - LZ_DIRECT_CODES) & 3)) << (top - 2)) | readBits(br, top - 2);
+    return 1;
+    }
+
+// Match finder over one block: a head table of the latest position per hash
+// and, for levels that search more than one candidate, a chain linking each
+// position to the previous one with the same hash
+struct LzMatcher {
+    const unsigned char* in;
+    size_t n;
+    int32_t* head;
+    int32_t* chain;
+    int hash_bits;
+    size_t inserted;   // Positions below this are in the tables
+    size_t window;
+    const struct LzLevel* level;
+    };
+
+// Add positions up to (not including) end to the hash chains
+static void lzInsert(struct LzMatcher* m, size_t end)
+    {
+    if (end > m->n - LZ_LOOKAHEAD + 1)
+        end = m->n - LZ_LOOKAHEAD + 1;
+    for (size_t p = m->inserted; p < end; p++) {
+        uint32_t h = lzHash(m->in + p, m->hash_bits);
+        if (m->chain != NULL)
+            m->chain[p] = m->head[h];
+        m->head[h] = (int32_t)p;
+        }
+    if (end > m->inserted)
+        m->inserted = end;
+    }
+
+// Longest match for position p within the window. With chains, p and the
+// positions before it are added first; a plain hash table only remembers the
+// positions searched. Returns the length (0 for none) and sets *dist.
+static size_t lzFind(struct LzMatcher* m, size_t p, size_t* dist)
+    {
+    const unsigned char* cur = m->in + p;
+    size_t limit = m->n - p;
+    size_t best = 0;
+
+    if (m->chain != NULL)
+        lzInsert(m, p);
+    uint32_t h = lzHash(cur, m->hash_bits);
+    int32_t cand = m->head[h];
+    if (m->chain != NULL)
+        m->chain[p] = cand;
+    m->head[h] = (int32_t)p;
+    m->inserted = p + 1;
+
+    for (int depth = m->level->chain > 0 ? m->level->chain : 1; cand >= 0 && depth > 0; depth--) {
+        size_t d = p - (size_t)cand;
+        if (d > m->window)
+            break;
+
+        // A candidate can only win if it also matches the byte after the best length
+        const unsigned char* match = m->in + cand;
+        if (match[best] == cur[best]) {
+            size_t len = matchLength(match, cur, limit);
+            if (len > best) {
+                best = len;
+                *dist = d;
+                if (len >= (size_t)m->level->nice || len == limit)
+                    break;
+                }
+            }
+
+        if (m->chain == NULL)
+            break;
+        cand = m->chain[cand];
+        }
+    return best >= LZ_MIN_MATCH ? best : 0;
+    }
+
+// Parse a block into matches and literals, and code it as a BLOCK_LZ payload
+// into out (BLOCK_BOUND(n) bytes). Returns 0 when no matches were found or the
+// payload wouldn't be smaller than limit bytes; the caller then codes the
+// bytes on their own.
+size_t compressLz(const struct CodecOptions* options, const unsigned char* in, size_t n, unsigned char* out,
+    size_t limit, uint64_t* limit_cost)
+    {
+    struct CodecStats* stats = options->stats;
+    struct LzMatcher m;
+    size_t max_seqs = n / LZ_MIN_MATCH + 1;
+    size_t extra_cap = LZ_EXTRA_BOUND(max_seqs);
+    uint64_t start = stats ? getTimeNs() : 0;
+
+    m.in = in;
+    m.n = n;
+    m.level = &lzLevels[options->lz_level];
+    m.window = options->lz_window;
+    m.inserted = 0;
+    m.hash_bits = LZ_HASH_BITS;
+    while (m.hash_bits > 10 && ((size_t)1 << (m.hash_bits - 1)) >= n)
+        m.hash_bits--;
+
+    // One allocation: hash head, chain, literals, length and distance codes,
+    // and the extra bits
+    size_t head_size = ((size_t)1 << m.hash_bits) * sizeof(int32_t);
+    size_t chain_size = m.level->chain > 0 ? n * sizeof(int32_t) : 0;
+    unsigned char* work = (unsigned char*)malloc(head_size + chain_size + n + 3 * max_seqs + extra_cap);
+    if (work == NULL)
+        return 0;
+    m.head = (int32_t*)work;
+    m.chain = chain_size > 0 ? (int32_t*)(work + head_size) : NULL;
+    unsigned char* literals = work + head_size + chain_size;
+    unsigned char* length_codes = literals + n;
+    unsigned char* distance_codes = length_codes + 2 * max_seqs;
+    unsigned char* extra_buffer = distance_codes + max_seqs;
+    memset(m.head, 0xFF, head_size);
+
+    struct BitWriter extra;
+    initBitWriter(&extra, NULL, extra_buffer);
+    size_t seqs = 0, nlit = 0, anchor = 0, p = 0;
+
+    while (p + LZ_LOOKAHEAD <= n) {
+        size_t dist = 0;
+        size_t len = lzFind(&m, p, &dist);
+
+        if (len == 0) {
+            // Step further the longer the run without a match
+            p += 1 + ((p - anchor) >> (m.chain != NULL ? LZ_SKIP_SHIFT : LZ_FAST_SKIP_SHIFT));
+            continue;
+            }
+
+        // Lazy matching: take a longer match that starts one byte later
+        while (m.level->lazy && p + 1 + LZ_LOOKAHEAD <= n) {
+            size_t next_dist = 0;
+            size_t next = lzFind(&m, p + 1, &next_dist);
+            if (next <= len)
+                break;
+            p++;
+            len = next;
+            dist = next_dist;
+            }
+
+        uint32_t value;
+        int bits;
+        length_codes[2 * seqs] = lzValueCode((uint32_t)(p - anchor), &value, &bits);
+        writeBits(&extra, value, bits);
+        length_codes[2 * seqs + 1] = lzValueCode((uint32_t)(len - LZ_MIN_MATCH), &value, &bits);
+        writeBits(&extra, value, bits);
+        distance_codes[seqs] = lzValueCode((uint32_t)(dist - 1), &value, &bits);
+        writeBits(&extra, value, bits);
+        memcpy(literals + nlit, in + anchor, p - anchor);
+        nlit += p - anchor;
+        seqs++;
+
+        // Chained levels index the inside of the match on the next search
+        p += len;
+        anchor = p;
+        }
+    memcpy(literals + nlit, in + anchor, n - anchor);
+    nlit += n - anchor;
+    size_t extra_size = finishBitWriter(&extra);
+    start = stageTime(stats, STAGE_MATCH, start);
+
+    if (seqs == 0) {
+        free(work);
+        return 0;
+        }
+
+    // Code each section into scratch space and append it while the payload
+    // stays under the limit
+    const unsigned char* section[LZ_STREAMS] = { literals, length_codes, distance_codes, extra_buffer };
+    size_t section_size[LZ_STREAMS] = { nlit, 2 * seqs, seqs, extra_size };
+    size_t largest = nlit > extra_size ? nlit : extra_size;
+    if (largest < 2 * seqs)
+        largest = 2 * seqs;
+    unsigned char* scratch = (unsigned char*)malloc(BLOCK_BOUND(largest));
+    size_t written = writeVarint(out, seqs);
+
+    for (int i = 0; i < LZ_STREAMS && scratch != NULL && written < limit; i++) {
+        uint64_t freq[MAX_CHARS] = { 0 };
+        uint64_t cost = 0;
+        size_t payload = 0;
+        int type = BLOCK_STORED;
+
+        if (section_size[i] > 0) {
+            start = stats ? getTimeNs() : 0;
+            countBufferFrequency(section[i], section_size[i], freq);
+            stageTime(stats, STAGE_HISTOGRAM, start);
+            payload = codeBlock(options, section[i], section_size[i], freq, scratch, &type, &cost);
+            }
+
+        unsigned char header[BLOCK_HEADER_MAX];
+        int len = 0;
+        header[len++] = (unsigned char)type;
+        len += writeVarint(header + len, section_size[i]);
+        len += writeVarint(header + len, payload);
+        if (written + len + payload >= limit) {
+            written = limit;
+            break;
+            }
+        memcpy(out + written, header, len);
+        memcpy(out + written + len, scratch, payload);
+        written += len + payload;
+        *limit_cost += cost;
+        }
+
+    free(scratch);
+    free(work);
+    return scratch != NULL && written < limit ? written : 0;
+    }
+
+// Compress one block. With options->lz_level the block is searched for
+// matches first and becomes BLOCK_LZ when that beats coding its bytes alone;
+// then with options->context it becomes BLOCK_CONTEXT when that beats the
+// entropy of its bytes; otherwise see codeBlock. out must hold BLOCK_BOUND(n) bytes. Returns the
+// payload size and sets the block type.
+size_t compressBlock(const struct CodecOptions* options, const unsigned char* in, size_t n, unsigned char* out,
+    int* type, uint64_t* limit_cost)
+    {
+    uint64_t freq[MAX_CHARS] = { 0 };
+    struct CodecStats* stats = options->stats;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    if (stats != NULL)
+        statAdd(&stats->blocks, 1);
+    countBufferFrequency(in, n, freq);
+    stageTime(stats, STAGE_HISTOGRAM, start);
+
+    // The entropy of the bytes bounds what coding them alone could reach
+    *limit_cost = 0;
+    if (options->lz_level > 0 && n >= LZ_MIN_BLOCK && freq[in[0]] < n) {
+        size_t alone = (size_t)(entropyBits(freq, n) / 8) + CODE_LENGTHS_SIZE;
+        size_t payload = compressLz(options, in, n, out, alone < n ? alone : n, limit_cost);
+        if (payload > 0) {
+            *type = BLOCK_LZ;
+            return payload;
+            }
+        *limit_cost = 0;
+        }
+
+    // Order-0 codes can't beat the entropy, so context tables that do win
+    if (options->context && n >= CONTEXT_MIN_BLOCK && freq[in[0]] < n) {
+        size_t alone = (size_t)(entropyBits(freq, n) / 8);
+        size_t payload = codeContext(options, in, n, out, alone < n ? alone : n, limit_cost);
+        if (payload > 0) {
+            *type = BLOCK_CONTEXT;
+            return payload;
+            }
+        *limit_cost = 0;
+        }
+    return codeBlock(options, in, n, freq, out, type, limit_cost);
+    }
+
+// Decode a stored, single-byte, tANS, context or Huffman payload into n bytes, reusing
+// the cached decode table when a Huffman payload's code lengths match it.
+// Returns 0 if the payload is corrupt.
+static int decodePayload(struct DecodeCache* cache, int type, const unsigned char* in, size_t size,
+    unsigned char* out, size_t n)
+    {
+    struct DecodeTable* table = &cache->table;
+    struct BitReader br[STREAM_COUNT];
+    struct CodecStats* stats = cache->stats;
+
+    if (type == BLOCK_STORED) {
+        if (size != n)
+            return 0;
+        memcpy(out, in, n);
+        return 1;
+        }
+    if (type == BLOCK_SINGLE) {
+        if (size != 1)
+            return 0;
+        memset(out, in[0], n);
+        return 1;
+        }
+
+    if (type == BLOCK_ANS)
+        return decodeAnsPayload(cache, in, size, out, n);
+    if (type == BLOCK_CONTEXT)
+        return decodeContextPayload(cache, in, size, out, n);
+    if (size < CODE_LENGTHS_SIZE)
+        return 0;
+
+    uint64_t start = stats ? getTimeNs() : 0;
+    if (!cache->valid || memcmp(cache->lengths, in, CODE_LENGTHS_SIZE) != 0) {
+        int lens[MAX_CHARS];
+        uint64_t codes[MAX_CHARS];
+
+        cache->valid = 0;
+        if (!readCodeLengths(in, lens))
+            return 0;
+        assignCanonicalCodes(lens, codes);
+        if (!buildDecodeTable(table, codes, lens))
+            return 0;
+        memcpy(cache->lengths, in, CODE_LENGTHS_SIZE);
+        cache->valid = 1;
+        if (stats != NULL)
+            statAdd(&stats->tables_built, 1);
+        start = stageTime(stats, STAGE_TABLES, start);
+        }
+
+    in += CODE_LENGTHS_SIZE;
+    size -= CODE_LENGTHS_SIZE;
+
+    if (type == BLOCK_HUFFMAN) {
+        initBitReaderMemory(&br[0], in, size);
+        int ok = decodeSymbols(table, &br[0], out, n);
+        stageTime(stats, STAGE_CODING, start);
+        if (!ok)
+            return 0;
+
+        // Bits taken from the zero padding mean the payload was cut short
+        return br[0].padding * 8 <= br[0].count;
+        }
+
+    if (type != BLOCK_HUFFMAN4 || size < STREAM_JUMP_SIZE)
+        return 0;
+
+    // Locate the streams through the jump table
+    const unsigned char* jump = in;
+    const unsigned char* pos = in + STREAM_JUMP_SIZE;
+    const unsigned char* end = in + size;
+    unsigned char* stream_out[STREAM_COUNT];
+    size_t quarter = n / STREAM_COUNT;
+
+    for (int s = 0; s < STREAM_COUNT; s++) {
+        size_t stream_size = end - pos;
+        if (s < STREAM_COUNT - 1) {
+            stream_size = 0;
+            for (int i = 0; i < 4; i++)
+                stream_size |= (size_t)jump[4 * s + i] << (8 * i);
+            if (stream_size > (size_t)(end - pos))
+                return 0;
+            }
+
+        initBitReaderMemory(&br[s], pos, stream_size);
+        stream_out[s] = out + s * quarter;
+        pos += stream_size;
+        }
+
+    // Every stream decodes a full quarter in lockstep, then the last stream
+    // finishes the remainder
+    int ok = decodeStreams(table, br, stream_out, quarter) &&
+        decodeSymbols(table, &br[STREAM_COUNT - 1], stream_out[STREAM_COUNT - 1] + quarter,
+            n - STREAM_COUNT * quarter);
+    stageTime(stats, STAGE_CODING, start);
+    if (!ok)
+        return 0;
+
+    for (int s = 0; s < STREAM_COUNT; s++)
+        if (br[s].padding * 8 > br[s].count)
+            return 0;
+    return 1;
+    }
+
+// Decode a BLOCK_LZ payload into n bytes: decode its sections, then replay
+// the sequences. Returns 0 if the payload is corrupt, or HUFF_ERROR_MEMORY if
+// the section buffer can't be allocated.
+int decompressLz(struct DecodeCache* cache, const unsigned char* in, size_t size, unsigned char* out, size_t n)
+    {
+    const unsigned char* pos = in;
+    const unsigned char* end = in + size;
+    const unsigned char* payload[LZ_STREAMS];
+    uint64_t section_size[LZ_STREAMS], payload_size[LZ_STREAMS], seqs;
+    int type[LZ_STREAMS];
+
+    if (!readVarint(&pos, end, &seqs) || seqs > n / LZ_MIN_MATCH)
+        return 0;
+    for (int i = 0; i < LZ_STREAMS; i++) {
+        if (pos == end)
+            return 0;
+        type[i] = *pos++;
+        if (!readVarint(&pos, end, &section_size[i]) || !readVarint(&pos, end, &payload_size[i]) ||
+            payload_size[i] > (uint64_t)(end - pos))
+            return 0;
+        payload[i] = pos;
+        pos += payload_size[i];
+        }
+    if (pos != end || section_size[0] > n || section_size[1] != 2 * seqs || section_size[2] != seqs ||
+        section_size[3] > LZ_EXTRA_BOUND(seqs))
+        return 0;
+
+    size_t total = 0;
+    for (int i = 0; i < LZ_STREAMS; i++)
+        total += section_size[i];
+    unsigned char* work = (unsigned char*)malloc(total + 1);
+    if (work == NULL)
+        return HUFF_ERROR_MEMORY;
+
+    unsigned char* section[LZ_STREAMS];
+    int ok = 1;
+    total = 0;
+    for (int i = 0; i < LZ_STREAMS && ok; i++) {
+        section[i] = work + total;
+        total += section_size[i];
+        ok = decodePayload(cache, type[i], payload[i], payload_size[i], section[i], section_size[i]);
+        }
+    if (!ok) {
+        free(work);
+        return 0;
+        }
+
+    // Replay the sequences, checking every length and distance against the block
+    struct CodecStats* stats = cache->stats;
+    uint64_t start = stats ? getTimeNs() : 0;
+    const unsigned char* literals = section[0];
+    size_t nlit = section_size[0], lit = 0, done = 0;
+    struct BitReader extra;
+    initBitReaderMemory(&extra, section[3], section_size[3]);
+
+    for (uint64_t i = 0; i < seqs && ok; i++) {
+        uint32_t run, len, dist;
+        ok = lzValue(section[1][2 * i], &extra, &run) && lzValue(section[1][2 * i + 1], &extra, &len) &&
+            lzValue(section[2][i], &extra, &dist) &&
+            run <= nlit - lit && run <= n - done;
+        if (!ok)
+            break;
+        memcpy(out + done, literals + lit, run);
+        lit += run;
+        done += run;
+
+        uint64_t length = (uint64_t)len + LZ_MIN_MATCH;
+        uint64_t distance = (uint64_t)dist + 1;
+        ok = length <= n - done && distance <= done;
+        if (!ok)
+            break;
+        unsigned char* dst = out + done;
+        const unsigned char* src = dst - distance;
+        if (distance >= length) {
+            memcpy(dst, src, length);
+            }
+        else {
+            for (uint64_t k = 0; k < length; k++)
+                dst[k] = src[k];
+            }
+        done += length;
+        }
+
+    // The literals left over fill the rest of the block
+    if (ok && nlit - lit == n - done)
+        memcpy(out + done, literals + lit, n - done);
+    else
+        ok = 0;
+    stageTime(stats, STAGE_MATCH, start);
+
+    free(work);
+    return ok && extra.padding * 8 <= extra.count;
+    }
+
+// Decode a payload of the given block type into n bytes, reusing the cached
+// decode table when a Huffman block's code lengths match it. Returns 1 on
+// success, 0 if the payload is corrupt or HUFF_ERROR_MEMORY if it couldn't be
+// decoded for lack of memory.
+int decompressBlockCached(struct DecodeCache* cache, int type, const unsigned char* in, size_t size,
+    unsigned char* out, size_t n)
+    {
+    if (cache->stats != NULL)
+        statAdd(&cache->stats->blocks, 1);
+    if (type == BLOCK_LZ)
+        return decompressLz(cache, in, size, out, n);
+    return decodePayload(cache, type, in, size, out, n);
+    }
+
+// Pool task wrapper for compressBlock
+static void compressBlockTask(void* arg)
+    {
+    struct BlockJob* job = (struct BlockJob*)arg;
+    job->out_size = compressBlock(job->options, job->in, job->in_size, job->out, &job->type, &job->limit_cost);
+    }
+
+// Decode one block record (type byte, sizes, payload) described by an index
+// entry into dest. Returns 0 if the record doesn't match the entry or is
+// corrupt, and otherwise what decompressBlockCached returns.
+int decodeBlockRecord(struct DecodeCache* cache, const unsigned char* record, const struct BlockIndexEntry* e,
+    uint64_t block_size, unsigned char* dest)
+    {
+    const unsigned char* pos = record + 1;
+    const unsigned char* end = record + e->size;
+    uint64_t n, size;
+
+    if (e->size == 0 ||
+        !readVarint(&pos, end, &n) || !readVarint(&pos, end, &size) ||
+        n != e->original_size || n > block_size || size != (uint64_t)(end - pos))
+        return 0;
+    return decompressBlockCached(cache, record[0], pos, size, dest, n);
+    }
+
+// Pool task for parallel decompression: claim blocks until none are left.
+// Mapped files are decoded in place; otherwise each block is read with pread
+// and written to its final offset with pwrite.
+static void decompressBlocksTask(void* arg)
+    {
+    struct ParallelDecode* d = (struct ParallelDecode*)arg;
+    size_t record_max = BLOCK_HEADER_MAX + BLOCK_BOUND(d->block_size);
+    unsigned char* record = NULL;
+    unsigned char* block = NULL;
+    struct DecodeCache cache;
+
+    cache.valid = 0;
+    cache.stats = &codecStats;
+
+    if (d->in_map == NULL) {
+        record = (unsigned char*)malloc(record_max);
+        block = (unsigned char*)malloc(d->block_size);
+        if (record == NULL || block == NULL)
+            __atomic_store_n(&d->failed, HUFF_ERROR_MEMORY, __ATOMIC_RELAXED);
+        }
+
+    while (!__atomic_load_n(&d->failed, __ATOMIC_RELAXED)) {
+        uint64_t i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+        if (i >= d->count)
+            break;
+
+        const struct BlockIndexEntry* e = &d->index[i];
+        int ok;
+
+        if (d->in_map != NULL) {
+            ok = decodeBlockRecord(&cache, d->in_map + e->offset, e, d->block_size, d->out_map + e->original_offset);
+            }
+        else {
+            ok = e->size <= record_max &&
+                pread(d->in_fd, record, e->size, (off_t)e->offset) == (ssize_t)e->size;
+            if (ok)
+                ok = decodeBlockRecord(&cache, record, e, d->block_size, block);
+            if (ok > 0)
+                ok = pwrite(d->out_fd, block, e->original_size, (off_t)e->original_offset) ==
+                    (ssize_t)e->original_size;
+            }
+
+        if (ok <= 0)
+            __atomic_store_n(&d->failed, ok < 0 ? ok : HUFF_ERROR_CORRUPT, __ATOMIC_RELAXED);
+        progressAdvance(e->original_size);
+        }
+
+    free(record);
+    free(block);
+    }
+
+// FNV-1a hash of a table's packed code lengths, used as its ID
+uint32_t tableId(const unsigned char lengths[])
+    {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < CODE_LENGTHS_SIZE; i++) {
+        hash ^= lengths[i];
+        hash *= 16777619u;
+        }
+    return hash;
+    }
+
+// Train a code table on the combined histogram of a corpus and write its
+// TABLE_FILE_SIZE-byte table file image. Every byte value counts at least
+// once, so any message can be coded with the table; 256 codes need at least
+// 8 bits, whatever the length limit.
+void trainTable(const uint64_t freq[], int max_len, unsigned char file[])
+    {
+    unsigned char chars[MAX_CHARS];
+    uint64_t freq_list[MAX_CHARS];
+    int lens[MAX_CHARS];
+    uint64_t limit_cost;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        chars[i] = i;
+        freq_list[i] = freq[i] + 1;
+        }
+    buildCodeLengths(chars, freq_list, MAX_CHARS, max_len < 8 ? 8 : max_len, lens, &limit_cost);
+
+    memcpy(file, TABLE_MAGIC, FORMAT_MAGIC_LEN);
+    writeCodeLengths(lens, file + FORMAT_MAGIC_LEN + 4);
+    uint32_t id = tableId(file + FORMAT_MAGIC_LEN + 4);
+    for (int i = 0; i < 4; i++)
+        file[FORMAT_MAGIC_LEN + i] = (unsigned char)(id >> (8 * i));
+    }
+
+// Look up a loaded table by ID
+struct TrainedTable* findTable(const struct TableCache* cache, uint32_t id)
+    {
+    for (int i = 0; i < cache->count; i++)
+        if (cache->table[i]->id == id)
+            return cache->table[i];
+    return NULL;
+    }
+
+// Check a table file image and add it to the cache with its encode and
+// decode tables built, so messages coded with it never rebuild a table. A
+// table that is already loaded is returned as is. Returns NULL if the image
+// is invalid, the cache is full or memory runs out.
+struct TrainedTable* loadTable(struct TableCache* cache, const unsigned char* file, size_t size)
+    {
+    const unsigned char* lengths = file + FORMAT_MAGIC_LEN + 4;
+    int lens[MAX_CHARS];
+    uint64_t codes[MAX_CHARS];
+    uint32_t id = 0;
+
+    if (size != TABLE_FILE_SIZE || memcmp(file, TABLE_MAGIC, FORMAT_MAGIC_LEN) != 0)
+        return NULL;
+    for (int i = 0; i < 4; i++)
+        id |= (uint32_t)file[FORMAT_MAGIC_LEN + i] << (8 * i);
+    if (id != tableId(lengths) || !readCodeLengths(lengths, lens))
+        return NULL;
+    for (int i = 0; i < MAX_CHARS; i++)
+        if (lens[i] == 0)
+            return NULL;
+
+    struct TrainedTable* table = findTable(cache, id);
+    if (table != NULL)
+        return table;
+    if (cache->count == MAX_TABLES)
+        return NULL;
+
+    table = (struct TrainedTable*)malloc(sizeof(struct TrainedTable));
+    if (table == NULL)
+        return NULL;
+    assignCanonicalCodes(lens, codes);
+    if (!buildDecodeTable(&table->decode, codes, lens)) {
+        free(table);
+        return NULL;
+        }
+    buildEncodeTable(&table->encode, codes, lens);
+    table->id = id;
+    memcpy(table->lengths, lengths, CODE_LENGTHS_SIZE);
+    cache->table[cache->count++] = table;
+    return table;
+    }
+
+// Release every table in the cache
+void freeTables(struct TableCache* cache)
+    {
+    for (int i = 0; i < cache->count; i++)
+        free(cache->table[i]);
+    cache->count = 0;
+    }
+
+// Compress n bytes with a trained table into a version 4 image. out must
+// hold TABLE_BOUND(n) bytes. Returns the image size.
+size_t compressWithTable(const struct TrainedTable* table, const unsigned char* in, size_t n, unsigned char* out)
+    {
+    struct BitWriter bw;
+    size_t len = FORMAT_MAGIC_LEN;
+
+    memcpy(out, TABLE_FORMAT_MAGIC, FORMAT_MAGIC_LEN);
+    for (int i = 0; i < 4; i++)
+        out[len++] = (unsigned char)(table->id >> (8 * i));
+    len += writeVarint(out + len, n);
+
+    initBitWriter(&bw, NULL, out + len);
+    encodeSymbols(&table->encode, &bw, in, n);
+    return len + finishBitWriter(&bw);
+    }
+
+// Compress in blocks of block_size bytes: read a batch of blocks, compress
+// them on the pool and write the results in input order. Blocks of a mapped
+// file are compressed straight from the mapping.
+int compressBlocks(FILE* in, const struct MappedFile* map, const char* output_file, int64_t file_size,
+    size_t block_size)
+    {
+    int batch = numThreads;
+    struct BlockJob* jobs = (struct BlockJob*)calloc(batch, sizeof(struct BlockJob));
+    unsigned char* in_buffers = map ? NULL : (unsigned char*)malloc((size_t)batch * block_size);
+    unsigned char* out_buffers = (unsigned char*)malloc((size_t)batch * BLOCK_BOUND(block_size));
+
+    if (jobs == NULL || (map == NULL && in_buffers == NULL) || out_buffers == NULL) {
+        printf("ERROR: Memory allocation failed\n");
+        free(jobs);
+        free(in_buffers);
+        free(out_buffers);
+        return 0;
+        }
+
+    note("Opening output file: %s\n", output_file);
+    FILE* out = openOutput(output_file);
+    if (out == NULL) {
+        printf("Error opening output file\n");
+        free(jobs);
+        free(in_buffers);
+        free(out_buffers);
+        return 0;
+        }
+
+    struct ThreadPool pool;
+    if (!poolInit(&pool, numThreads)) {
+        printf("ERROR: Failed to start worker threads\n");
+        fclose(out);
+        free(jobs);
+        free(in_buffers);
+        free(out_buffers);
+        return 0;
+        }
+
+    note("Compressing in %zu KB blocks with %d thread(s)...\n", block_size >> 10, numThreads);
+
+    // Reading ahead and writing behind run on their own threads, so the pool
+    // doesn't wait for the disk between batches
+    struct IoRing reader, writer;
+    if (map == NULL)
+        ioStart(&reader, in, 0);
+    ioStart(&writer, out, 1);
+
+    // Header: format magic and nominal block size
+    unsigned char header[FORMAT_MAGIC_LEN + 10];
+    int header_len = FORMAT_MAGIC_LEN;
+    memcpy(header, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN);
+    header_len += writeVarint(header + header_len, block_size);
+    ioWrite(&writer, header, header_len);
+
+    uint64_t total_read = 0, total_written = header_len, limit_cost = 0, blocks = 0, uncoded = 0;
+    uint64_t index_capacity = 0;
+    struct BlockIndexEntry* index = NULL;
+    double start_time = getTimeSeconds();
+    progressBegin("Compressing", file_size > 0 ? (uint64_t)file_size : 0);
+
+    struct CodecOptions options = { maxCodeLength, useStreams, useAns, useContext, lzLevel, lzWindow,
+        &codecStats };
+    for (int i = 0; i < batch; i++) {
+        jobs[i].options = &options;
+        jobs[i].out = out_buffers + (size_t)i * BLOCK_BOUND(block_size);
+        }
+
+    size_t map_offset = 0;
+    int more = 1, out_of_memory = 0;
+    while (more) {
+        // Each block starts compressing as soon as it has been read
+        int count = 0;
+        while (count < batch) {
+            size_t got;
+
+            if (map != NULL) {
+                got = map->size - map_offset < block_size ? map->size - map_offset : block_size;
+                jobs[count].in = map->data + map_offset;
+                map_offset += got;
+                }
+            else {
+                unsigned char* buffer = in_buffers + (size_t)count * block_size;
+                got = ioRead(&reader, buffer, block_size);
+                jobs[count].in = buffer;
+                }
+
+            if (got == 0) {
+                more = 0;
+                break;
+                }
+
+            jobs[count].in_size = got;
+            poolSubmit(&pool, compressBlockTask, &jobs[count]);
+            count++;
+            }
+        poolWait(&pool);
+
+        for (int i = 0; i < count; i++) {
+            unsigned char block_header[BLOCK_HEADER_MAX];
+            int len = 0;
+
+            block_header[len++] = (unsigned char)jobs[i].type;
+            len += writeVarint(block_header + len, jobs[i].in_size);
+            len += writeVarint(block_header + len, jobs[i].out_size);
+            ioWrite(&writer, block_header, len);
+            ioWrite(&writer, jobs[i].out, jobs[i].out_size);
+
+            if (blocks == index_capacity) {
+                uint64_t capacity = index_capacity ? 2 * index_capacity : 64;
+                struct BlockIndexEntry* grown = (struct BlockIndexEntry*)realloc(index,
+                    capacity * sizeof(struct BlockIndexEntry));
+                if (grown == NULL) {
+                    printf("ERROR: Memory allocation failed\n");
+                    out_of_memory = 1;
+                    more = 0;
+                    break;
+                    }
+                index = grown;
+                index_capacity = capacity;
+                }
+            index[blocks].size = len + jobs[i].out_size;
+            index[blocks].original_size = jobs[i].in_size;
+
+            total_read += jobs[i].in_size;
+            total_written += len + jobs[i].out_size;
+            limit_cost += jobs[i].limit_cost;
+            if (jobs[i].type == BLOCK_STORED || jobs[i].type == BLOCK_SINGLE)
+                uncoded++;
+            blocks++;
+            }
+        progressUpdate(total_read);
+        }
+
+    // Running out of memory abandons the output without an end marker or index
+    if (!out_of_memory) {
+        unsigned char end_marker = BLOCK_END;
+        ioWrite(&writer, &end_marker, 1);
+        total_written++;
+        total_written += writeBlockIndex(&writer, index, blocks, total_written);
+        }
+
+    int ok = ioFinish(&writer);
+    if (map == NULL && !ioFinish(&reader) && !out_of_memory) {
+        printf("ERROR: Failed to read input file\n");
+        ok = 0;
+        }
+    double elapsed = getTimeSeconds() - start_time;
+
+    poolDestroy(&pool);
+    if ((fclose(out) != 0 || !ok) && !out_of_memory) {
+        printf("ERROR: Failed to write output file\n");
+        ok = 0;
+        }
+    if (out_of_memory)
+        ok = 0;
+    free(index);
+    free(jobs);
+    free(in_buffers);
+    free(out_buffers);
+    if (!ok)
+        return 0;
+
+    statAdd(&codecStats.bytes_in, total_read);
+    statAdd(&codecStats.bytes_out, total_written);
+    note("File compressed successfully.\n");
+    note("Original size: %llu bytes\n", (unsigned long long)total_read);
+    note("Compressed size: %llu bytes in %llu blocks\n",
+        (unsigned long long)total_written, (unsigned long long)blocks);
+    if (uncoded > 0)
+        note("%llu blocks stored without a code table\n", (unsigned long long)uncoded);
+    if (limit_cost > 0)
+        note("Limiting codes to %d bits costs %llu bytes\n", maxCodeLength,
+            (unsigned long long)((limit_cost + 7) / 8));
+
+    if (total_read > 0) {
+        float ratio = (float)total_written / total_read;
+        note("Compression ratio: %.2f%%\n", (1.0 - ratio) * 100);
+        }
+    if (elapsed > 0)
+        note("Compression throughput: %.2f MB/s\n", total_read / elapsed / 1e6);
+    return 1;
+    }
+
+// Decode all blocks on the worker pool using the block index. Returns -1 when
+// the input has no usable index or the output can't be written at offsets.
+int decompressBlocksParallel(FILE* in, FILE* out, uint64_t block_size, uint64_t data_start, uint64_t* decoded)
+    {
+    struct stat out_stat;
+    struct ParallelDecode d;
+
+    if (fstat(fileno(out), &out_stat) != 0 || !S_ISREG(out_stat.st_mode))
+        return -1;
+
+    struct BlockIndexEntry* index = readBlockIndex(in, data_start, &d.count);
+    if (index == NULL)
+        return -1;
+
+    uint64_t total = d.count ? index[d.count - 1].original_offset + index[d.count - 1].original_size : 0;
+    note("Decompressing %llu blocks with %d threads...\n", (unsigned long long)d.count, numThreads);
+    progressBegin("Decompressing", total);
+
+    d.index = index;
+    d.block_size = block_size;
+    d.in_fd = fileno(in);
+    d.out_fd = fileno(out);
+    d.in_map = NULL;
+    d.out_map = NULL;
+    d.next = 0;
+    d.failed = 0;
+
+    struct ThreadPool pool;
+    if (ftruncate(d.out_fd, (off_t)total) != 0 || !poolInit(&pool, numThreads)) {
+        free(index);
+        return -1;
+        }
+
+    for (int i = 0; i < numThreads; i++)
+        poolSubmit(&pool, decompressBlocksTask, &d);
+    poolWait(&pool);
+    poolDestroy(&pool);
+    free(index);
+
+    if (d.failed) {
+        printf(d.failed == HUFF_ERROR_MEMORY ? "ERROR: Not enough memory to decode blocks\n"
+            : "ERROR: Corrupt block in compressed data\n");
+        return 0;
+        }
+
+    *decoded = total;
+    return 1;
+    }
+
+// Decode a block-format stream (after its magic) into the output file
+int decompressBlocks(FILE* in, FILE* out, uint64_t* decoded)
+    {
+    uint64_t block_size;
+    *decoded = 0;
+
+    if (!readVarintFile(in, &block_size) || block_size == 0 || block_size > MAX_BLOCK_SIZE) {
+        printf("ERROR: Invalid block size in header\n");
+        return 0;
+        }
+
+    // With several threads and a seekable file, decode blocks concurrently
+    if (numThreads > 1) {
+        off_t data_start = ftello(in);
+        int result = data_start < 0 ? -1 :
+            decompressBlocksParallel(in, out, block_size, (uint64_t)data_start, decoded);
+
+        if (result >= 0)
+            return result;
+        if (data_start >= 0)
+            fseeko(in, data_start, SEEK_SET);
+        }
+
+    unsigned char* payload = (unsigned char*)malloc(BLOCK_BOUND(block_size));
+    unsigned char* block = (unsigned char*)malloc(block_size);
+    if (payload == NULL || block == NULL) {
+        printf("ERROR: Memory allocation failed\n");
+        free(payload);
+        free(block);
+        return 0;
+        }
+
+    // Progress follows the compressed input, whose size is known up front
+    struct stat in_stat;
+    int seekable = fstat(fileno(in), &in_stat) == 0 && S_ISREG(in_stat.st_mode);
+    progressBegin("Decompressing", seekable ? (uint64_t)in_stat.st_size : 0);
+
+    // Decoded blocks are written behind on their own thread
+    struct IoRing writer;
+    ioStart(&writer, out, 1);
+
+    // One decode cache lets runs of blocks with the same code lengths skip
+    // rebuilding their table
+    struct DecodeCache cache;
+    cache.valid = 0;
+    cache.stats = &codecStats;
+
+    int ok = 0;
+    while (1) {
+        int type = fgetc(in);
+        uint64_t n, size;
+
+        if (type == BLOCK_END) {
+            ok = 1;
+            break;
+            }
+        if (type < BLOCK_HUFFMAN || type > BLOCK_CONTEXT) {
+            printf(type == EOF ? "ERROR: Unexpected end of compressed file\n"
+                : "ERROR: Unknown block type in compressed data\n");
+            break;
+            }
+
+        if (!readVarintFile(in, &n) || !readVarintFile(in, &size) ||
+            n == 0 || n > block_size || size > BLOCK_BOUND(block_size)) {
+            printf("ERROR: Invalid block header\n");
+            break;
+            }
+
+        if (fread(payload, 1, size, in) != size) {
+            printf("ERROR: Unexpected end of compressed file\n");
+            break;
+            }
+
+        int status = decompressBlockCached(&cache, type, payload, size, block, n);
+        if (status <= 0) {
+            printf(status < 0 ? "ERROR: Not enough memory to decode blocks\n"
+                : "ERROR: Corrupt block in compressed data\n");
+            break;
+            }
+
+        ioWrite(&writer, block, n);
+        *decoded += n;
+        if (seekable)
+            progressUpdate((uint64_t)ftello(in));
+        }
+
+    if (!ioFinish(&writer) && ok) {
+        printf("ERROR: Failed to write output file\n");
+        ok = 0;
+        }
+
+    free(payload);
+    free(block);
+    return ok;
+    }
+
+// Open an input file; "-" is standard input
+FILE* openInput(const char* path)
+    {
+    if (strcmp(path, "-") == 0)
+        return stdin;
+    return fopen(path, "rb");
+    }
+
+// Hand standard output over to the data stream. Progress messages are moved
+// to standard error so they can't mix with the data; call this before
+// anything is printed.
+void reserveStdout(void)
+    {
+    if (dataOut != NULL)
+        return;
+
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0)
+        dataOut = fdopen(fd, "wb");
+    }
+
+// Open an output file; "-" is standard output. Files are opened for reading
+// too, which a shared writable mapping of them needs (see mapOutputFile).
+FILE* openOutput(const char* path)
+    {
+    if (strcmp(path, "-") != 0)
+        return fopen(path, "w+b");
+
+    reserveStdout();
+    return dataOut;
+    }
+
+// Map a non-empty regular file for sequential reading. Returns 0 when the
+// file can't be mapped and the buffered path has to be used.
+int mapInputFile(FILE* file, struct MappedFile* map)
+    {
+    struct stat st;
+
+    // Files larger than the address space are read through buffers instead
+    if (!useMmap || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (uint64_t)st.st_size > SIZE_MAX)
+        return 0;
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (data == MAP_FAILED)
+        return 0;
+
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    map->data = (unsigned char*)data;
+    map->size = (size_t)st.st_size;
+    return 1;
+    }
+
+// Release a mapping made by mapInputFile; unmapped files are left alone
+void unmapFile(struct MappedFile* map)
+    {
+    if (map->data != NULL)
+        munmap(map->data, map->size);
+    map->data = NULL;
+    map->size = 0;
+    }
+
+// Size a regular output file with ftruncate and map it for writing. Returns
+// NULL if the output isn't a regular file or is empty.
+unsigned char* mapOutputFile(FILE* file, uint64_t size)
+    {
+    struct stat st;
+
+    if (!useMmap || size == 0 || size > SIZE_MAX || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) ||
+        ftruncate(fileno(file), (off_t)size) != 0)
+        return NULL;
+
+    void* data = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    return data == MAP_FAILED ? NULL : (unsigned char*)data;
+    }
+
+// Decode a mapped compressed file into a mapped output file. Returns -1 when
+// the format (legacy, or block files without an index) or the output needs
+// the buffered path.
+int decompressMapped(const struct MappedFile* map, FILE* out, uint64_t* decoded)
+    {
+    const unsigned char* data = map->data;
+    *decoded = 0;
+
+    if (map->size >= HEADER_SIZE && memcmp(data, FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        int lens[MAX_CHARS];
+        uint64_t codes[MAX_CHARS];
+        uint64_t total = 0;
+        struct DecodeTable table;
+        struct BitReader br;
+
+        for (int i = 0; i < 8; i++)
+            total |= (uint64_t)data[FORMAT_MAGIC_LEN + i] << (8 * i);
+
+        uint64_t start = getTimeNs();
+        if (!readCodeLengths(data + FORMAT_MAGIC_LEN + 8, lens)) {
+            printf("ERROR: Header contains no code lengths\n");
+            return 0;
+            }
+        assignCanonicalCodes(lens, codes);
+        if (!buildDecodeTable(&table, codes, lens)) {
+            printf("ERROR: Code lengths in header do not form a valid prefix code\n");
+            return 0;
+            }
+        start = stageTime(&codecStats, STAGE_TABLES, start);
+
+        // Every code is at least one bit, so a size the payload can't hold
+        // comes from a damaged header and must not size the output file
+        if (total > (uint64_t)(map->size - HEADER_SIZE) * 8) {
+            printf("ERROR: Original size in header exceeds the compressed data\n");
+            return 0;
+            }
+
+        unsigned char* dest = mapOutputFile(out, total);
+        if (dest == NULL)
+            return -1;
+        statAdd(&codecStats.tables_built, 1);
+        statAdd(&codecStats.blocks, 1);
+
+        note("Decompressing %llu characters...\n", (unsigned long long)total);
+        progressBegin("Decompressing", total);
+        initBitReaderMemory(&br, data + HEADER_SIZE, map->size - HEADER_SIZE);
+
+        int ok = 1, truncated = 0;
+        while (*decoded < total && ok && !truncated) {
+            size_t chunk = total - *decoded < IO_BUFFER_SIZE ? (size_t)(total - *decoded) : IO_BUFFER_SIZE;
+            ok = decodeSymbols(&table, &br, dest + *decoded, chunk);
+            *decoded += chunk;
+            progressUpdate(*decoded);
+
+            // Bits taken from the zero padding mean the stream was cut short
+            truncated = br.padding * 8 > br.count;
+            }
+        stageTime(&codecStats, STAGE_CODING, start);
+        munmap(dest, total);
+
+        if (!ok) {
+            printf("ERROR: Invalid Huffman code in compressed data\n");
+            }
+        else if (truncated) {
+            printf("ERROR: Unexpected end of compressed file\n");
+            ok = 0;
+            }
+        return ok;
+        }
+
+    if (map->size > FORMAT_MAGIC_LEN && memcmp(data, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        const unsigned char* pos = data + FORMAT_MAGIC_LEN;
+        struct ParallelDecode d;
+        uint64_t block_size;
+
+        if (!readVarint(&pos, data + map->size, &block_size) || block_size == 0 || block_size > MAX_BLOCK_SIZE) {
+            printf("ERROR: Invalid block size in header\n");
+            return 0;
+            }
+
+        struct BlockIndexEntry* index = parseBlockIndex(data, map->size, map->size, pos - data, &d.count);
+        if (index == NULL)
+            return -1;
+
+        uint64_t total = d.count ? index[d.count - 1].original_offset + index[d.count - 1].original_size : 0;
+        unsigned char* dest = mapOutputFile(out, total);
+        struct ThreadPool pool;
+
+        if ((dest == NULL && total > 0) || !poolInit(&pool, numThreads)) {
+            if (dest != NULL)
+                munmap(dest, total);
+            free(index);
+            return -1;
+            }
+
+        note("Decompressing %llu blocks with %d thread(s)...\n", (unsigned long long)d.count, numThreads);
+        progressBegin("Decompressing", total);
+
+        d.index = index;
+        d.block_size = block_size;
+        d.in_fd = d.out_fd = -1;
+        d.in_map = data;
+        d.out_map = dest;
+        d.next = 0;
+        d.failed = 0;
+
+        for (int i = 0; i < numThreads; i++)
+            poolSubmit(&pool, decompressBlocksTask, &d);
+        poolWait(&pool);
+        poolDestroy(&pool);
+
+        if (dest != NULL)
+            munmap(dest, total);
+        free(index);
+
+        if (d.failed) {
+            printf(d.failed == HUFF_ERROR_MEMORY ? "ERROR: Not enough memory to decode blocks\n"
+                : "ERROR: Corrupt block in compressed data\n");
+            return 0;
+            }
+
+        *decoded = total;
+        return 1;
+        }
+
+    return -1;
+    }
+
+// Compress a whole input with the -D table into a version 4 file. The input
+// is read into memory, because the format stores its size up front.
+int compressWithDictionary(FILE* in, const char* output_file)
+    {
+    struct MappedFile map = { NULL, 0 };
+    unsigned char* data = NULL;
+    size_t n = 0;
+
+    if (mapInputFile(in, &map)) {
+        data = map.data;
+        n = map.size;
+        }
+    else {
+        size_t capacity = 0;
+        while (1) {
+            if (n == capacity) {
+                capacity = capacity ? 2 * capacity : IO_BUFFER_SIZE;
+                unsigned char* grown = (unsigned char*)realloc(data, capacity);
+                if (grown == NULL) {
+                    printf("ERROR: Memory allocation failed\n");
+                    free(data);
+                    fclose(in);
+                    return 0;
+                    }
+                data = grown;
+                }
+            size_t got = fread(data + n, 1, capacity - n, in);
+            if (got == 0)
+                break;
+            n += got;
+            }
+        }
+
+    unsigned char* packed = (unsigned char*)malloc(TABLE_BOUND(n));
+    int ok = !ferror(in) && packed != NULL;
+    size_t size = 0;
+    if (ok) {
+        uint64_t start = getTimeNs();
+        size = compressWithTable(dictTable, data, n, packed);
+        stageTime(&codecStats, STAGE_CODING, start);
+        }
+    else {
+        printf("ERROR: Failed to read input file\n");
+        }
+
+    if (map.data != NULL)
+        unmapFile(&map);
+    else
+        free(data);
+    fclose(in);
+
+    FILE* out = ok ? openOutput(output_file) : NULL;
+    if (ok && out == NULL) {
+        printf("Error opening output file\n");
+        ok = 0;
+        }
+    if (out != NULL) {
+        ok = fwrite(packed, 1, size, out) == size;
+        if (fclose(out) != 0 || !ok) {
+            printf("ERROR: Failed to write output file\n");
+            ok = 0;
+            }
+        }
+    free(packed);
+    if (!ok)
+        return 0;
+
+    statAdd(&codecStats.bytes_in, n);
+    statAdd(&codecStats.bytes_out, size);
+    statAdd(&codecStats.blocks, 1);
+    note("File compressed successfully.\n");
+    note("Original size: %zu bytes\n", n);
+    note("Compressed size: %zu bytes with trained table %08x\n", size, dictTable->id);
+    return 1;
+    }
+
+// Compress the input file and write to output file. Returns 0 on failure.
+int compressFile(const char* input_file, const char* output_file)
+    {
+    FILE* in, * out;
+    uint64_t freq[MAX_CHARS] = { 0 };
+    int i;
+    uint64_t fileSize = 0;
+
+    note("Starting compression with %s kernels...\n", kernels->name);
+    note("Opening input file: %s\n", input_file);
+
+    // Open input file
+    in = openInput(input_file);
+    if (in == NULL) {
+        printf("Error opening input file\n");
+        return 0;
+        }
+
+    note("Input file opened successfully\n");
+
+    if (dictTable != NULL)
+        return compressWithDictionary(in, output_file);
+
+    // Pipes can't be rewound for a second pass, so they are always compressed
+    // block by block as the data arrives
+    struct stat in_stat;
+    int64_t file_size = -1;
+    if (fstat(fileno(in), &in_stat) == 0 && S_ISREG(in_stat.st_mode))
+        file_size = in_stat.st_size;
+
+    size_t block_size = blockSize;
+    if (file_size < 0) {
+        if (block_size == 0)
+            block_size = DEFAULT_BLOCK_SIZE;
+        note("Input is not a regular file, streaming in blocks\n");
+        }
+    else if (file_size == 0) {
+        printf("ERROR: Input file is empty or cannot be read\n");
+        fclose(in);
+        return 0;
+        }
+
+    // Regular files are mapped so both passes run on the mapping
+    struct MappedFile map = { NULL, 0 };
+    if (mapInputFile(in, &map))
+        note("Input file mapped into memory\n");
+
+    // Block mode reads every byte once and compresses blocks in parallel
+    if (block_size > 0) {
+        int ok = compressBlocks(in, map.data ? &map : NULL, output_file, file_size, block_size);
+        unmapFile(&map);
+        fclose(in);
+        return ok;
+        }
+
+    // Count frequency of each character. A sampled table leaves the encode
+    // loop as the only full read of the input.
+    uint64_t stage_start = getTimeNs();
+    if (sampleMode) {
+        fileSize = (uint64_t)file_size;
+        if (countSampleFrequency(in, map.data ? &map : NULL, (uint64_t)file_size, freq) == 0) {
+            printf("ERROR: Failed to read input file\n");
+            unmapFile(&map);
+            fclose(in);
+            return 0;
+            }
+        }
+    else if (map.data != NULL)
+        countMemoryFrequency(map.data, map.size, freq, &fileSize);
+    else
+        countFrequency(in, freq, &fileSize);
+    stage_start = stageTime(&codecStats, STAGE_HISTOGRAM, stage_start);
+
+    // Create array of characters and their frequencies
+    unsigned char chars[MAX_CHARS];
+    uint64_t freq_list[MAX_CHARS];
+    int size = 0;
+
+    note("Building character frequency list...\n");
+    for (i = 0; i < MAX_CHARS; i++) {
+        if (freq[i] > 0) {
+            chars[size] = i;
+            freq_list[size] = freq[i];
+            size++;
+            }
+        }
+
+    note("Found %d unique characters\n", size);
+
+    // Check if the file has any content
+    if (size == 0 || fileSize == 0) {
+        printf("ERROR: The input file is empty or no valid characters were found\n");
+        unmapFile(&map);
+        fclose(in);
+        return 0;
+        }
+
+    // Data that a single code table can't shrink goes to block format instead,
+    // where each block may be stored, filled from one byte, or coded when a
+    // part of the file does compress
+    uint64_t counted = 0;
+    for (i = 0; i < MAX_CHARS; i++)
+        counted += freq[i];
+    if (!worthCoding(freq, counted)) {
+        note("Little to gain from one code table, switching to blocks\n");
+        rewind(in);
+        int ok = compressBlocks(in, map.data ? &map : NULL, output_file, file_size, DEFAULT_BLOCK_SIZE);
+        unmapFile(&map);
+        fclose(in);
+        return ok;
+        }
+
+    // Create and store Huffman codes
+    uint64_t codes[MAX_CHARS];
+    int lens[MAX_CHARS];
+    struct EncodeTable table;
+    stage_start = getTimeNs();
+    HuffmanCodes(chars, freq_list, size, lens, codes);
+    buildEncodeTable(&table, codes, lens);
+    statAdd(&codecStats.tables_built, 1);
+    stageTime(&codecStats, STAGE_TABLES, stage_start);
+
+    note("Opening output file: %s\n", output_file);
+
+    // Open output file
+    out = openOutput(output_file);
+    if (out == NULL) {
+        printf("Error opening output file\n");
+        unmapFile(&map);
+        fclose(in);
+        return 0;
+        }
+
+    note("Output file opened successfully\n");
+    note("Writing compressed data header...\n");
+
+    // Write header: format magic, original size and the canonical code lengths
+    unsigned char header[HEADER_SIZE];
+    uint64_t original_size = fileSize;
+
+    memcpy(header, FORMAT_MAGIC, FORMAT_MAGIC_LEN);
+    for (i = 0; i < 8; i++)
+        header[FORMAT_MAGIC_LEN + i] = (unsigned char)(original_size >> (8 * i));
+    writeCodeLengths(lens, header + FORMAT_MAGIC_LEN + 8);
+
+    // Compress and write data
+    note("Compressing data...\n");
+    rewind(in);
+
+    unsigned char* read_buffer = map.data ? NULL : (unsigned char*)malloc(IO_BUFFER_SIZE);
+    unsigned char* write_buffer = (unsigned char*)malloc(2 * IO_BUFFER_SIZE + 8);
+    if ((map.data == NULL && read_buffer == NULL) || write_buffer == NULL) {
+        printf("ERROR: Memory allocation failed\n");
+        free(read_buffer);
+        free(write_buffer);
+        unmapFile(&map);
+        fclose(in);
+        fclose(out);
+        return 0;
+        }
+
+    struct BitWriter bw;
+    size_t bytes_read;
+    uint64_t total_read = 0;
+    double start_time = getTimeSeconds();
+    stage_start = getTimeNs();
+    progressBegin("Compressing", fileSize);
+
+    // The exact histogram of a sampled run is only needed for its report
+    uint64_t exact[MAX_CHARS] = { 0 };
+    int track_exact = sampleMode && verbose;
+
+    // Reads and writes overlap with encoding on their own threads
+    struct IoRing reader, writer;
+    if (map.data == NULL)
+        ioStart(&reader, in, 0);
+    ioStart(&writer, out, 1);
+    ioWrite(&writer, header, HEADER_SIZE);
+
+    initBitWriter(&bw, &writer, write_buffer);
+
+    while (1) {
+        // Mapped input is encoded in place, one buffer-sized slice at a time
+        const unsigned char* chunk = read_buffer;
+        if (map.data != NULL) {
+            chunk = map.data + total_read;
+            bytes_read = map.size - total_read < IO_BUFFER_SIZE ? map.size - total_read : IO_BUFFER_SIZE;
+            }
+        else {
+            bytes_read = ioRead(&reader, read_buffer, IO_BUFFER_SIZE);
+            }
+        if (bytes_read == 0)
+            break;
+
+        if (track_exact)
+            countBufferFrequency(chunk, bytes_read, exact);
+        encodeSymbols(&table, &bw, chunk, bytes_read);
+        flushBitWriter(&bw, 0);
+
+        total_read += bytes_read;
+        progressUpdate(total_read);
+        }
+
+    // Write remaining bits if any
+    flushBitWriter(&bw, 1);
+    int ok = ioFinish(&writer);
+    if (map.data == NULL && !ioFinish(&reader)) {
+        printf("ERROR: Failed to read input file\n");
+        ok = 0;
+        }
+    double elapsed = getTimeSeconds() - start_time;
+    stageTime(&codecStats, STAGE_CODING, stage_start);
+    uint64_t total_bytes = bw.written;
+
+    // Close files
+    free(read_buffer);
+    free(write_buffer);
+    unmapFile(&map);
+    fclose(in);
+    if (fclose(out) != 0 || !ok) {
+        printf("ERROR: Failed to write output file\n");
+        return 0;
+        }
+
+    uint64_t compressed_size = total_bytes + HEADER_SIZE;
+    statAdd(&codecStats.bytes_in, fileSize);
+    statAdd(&codecStats.bytes_out, compressed_size);
+    statAdd(&codecStats.blocks, 1);
+    note("File compressed successfully.\n");
+    note("Original size: %llu bytes\n", (unsigned long long)fileSize);
+    note("Compressed size: %llu bytes (Header: %d bytes, Data: %llu bytes)\n",
+        (unsigned long long)compressed_size, HEADER_SIZE, (unsigned long long)total_bytes);
+    if (track_exact)
+        noteSampleCost(exact, lens);
+
+    if (fileSize > 0) {
+        float ratio = (float)compressed_size / fileSize;
+        note("Compression ratio: %.2f%%\n", (1.0 - ratio) * 100);
+        }
+    if (elapsed > 0)
+        note("Compression throughput: %.2f MB/s\n", total_read / elapsed / 1e6);
+    return 1;
+    }
+
+// Count a finished decompression in the stats. The compressed size is taken
+// from the file system, so piped input counts as 0 bytes in.
+void statDecompressed(FILE* in, uint64_t decoded)
+    {
+    struct stat st;
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode))
+        statAdd(&codecStats.bytes_in, (uint64_t)st.st_size);
+    statAdd(&codecStats.bytes_out, decoded);
+    }
+
+// Decompress the input file and write to output file
+int decompressFile(const char* input_file, const char* output_file)
+    {
+    FILE* in, * out;
+    int size, i;
+
+    note("Starting decompression with %s kernels...\n", kernels->name);
+    note("Opening input file: %s\n", input_file);
+
+    // Open input file
+    in = openInput(input_file);
+    if (in == NULL) {
+        printf("Error opening input file\n");
+        return 0;
+        }
+
+    note("Input file opened successfully\n");
+    note("Opening output file: %s\n", output_file);
+
+    // Open output file
+    out = openOutput(output_file);
+    if (out == NULL) {
+        printf("Error opening output file\n");
+        fclose(in);
+        return 0;
+        }
+
+    note("Output file opened successfully\n");
+
+    // Regular files are decoded straight from a mapping into a pre-sized,
+    // mapped output file
+    struct MappedFile map = { NULL, 0 };
+    if (mapInputFile(in, &map)) {
+        double start_time = getTimeSeconds();
+        uint64_t decoded_bytes;
+        int result = decompressMapped(&map, out, &decoded_bytes);
+        double elapsed = getTimeSeconds() - start_time;
+
+        unmapFile(&map);
+        if (result >= 0) {
+            if (result)
+                statDecompressed(in, decoded_bytes);
+            fclose(in);
+            fclose(out);
+
+            if (result) {
+                note("File decompressed successfully.\n");
+                if (elapsed > 0)
+                    note("Decompression throughput: %.2f MB/s\n", decoded_bytes / elapsed / 1e6);
+                }
+            else if (strcmp(output_file, "-") != 0) {
+                // Leave no zero-padded output of a damaged file behind
+                unlink(output_file);
+                }
+            return result;
+            }
+        }
+
+    note("Reading header information...\n");
+
+    unsigned char magic[FORMAT_MAGIC_LEN];
+    if (fread(magic, 1, FORMAT_MAGIC_LEN, in) != FORMAT_MAGIC_LEN) {
+        printf("ERROR: Failed to read header\n");
+        fclose(in);
+        fclose(out);
+        return 0;
+        }
+
+    if (memcmp(magic, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        double start_time = getTimeSeconds();
+        uint64_t decoded_bytes;
+        int ok = decompressBlocks(in, out, &decoded_bytes);
+        double elapsed = getTimeSeconds() - start_time;
+
+        if (ok)
+            statDecompressed(in, decoded_bytes);
+        fclose(in);
+        fclose(out);
+
+        if (ok) {
+            note("File decompressed successfully.\n");
+            if (elapsed > 0)
+                note("Decompression throughput: %.2f MB/s\n", decoded_bytes / elapsed / 1e6);
+            }
+        return ok;
+        }
+
+    uint64_t codes[MAX_CHARS] = { 0 };
+    int lens[MAX_CHARS] = { 0 };
+    uint64_t total_chars = 0;
+    int single_char = -1;
+    const struct TrainedTable* trained = NULL;
+
+    if (memcmp(magic, TABLE_FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        // Dictionary format: the table comes from the -D cache, not the file
+        unsigned char id_bytes[4];
+        uint32_t id = 0;
+
+        if (fread(id_bytes, 1, 4, in) != 4 || !readVarintFile(in, &total_chars)) {
+            printf("ERROR: Failed to read header\n");
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+        for (i = 0; i < 4; i++)
+            id |= (uint32_t)id_bytes[i] << (8 * i);
+
+        trained = findTable(&tableCache, id);
+        if (trained == NULL) {
+            printf("ERROR: File was compressed with table %08x, which isn't loaded (use -D)\n", id);
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+        note("Using trained table %08x\n", id);
+        }
+    else if (memcmp(magic, FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        // Canonical format: the codes follow directly from the stored lengths
+        unsigned char header[HEADER_SIZE - FORMAT_MAGIC_LEN];
+
+        if (fread(header, 1, sizeof(header), in) != sizeof(header)) {
+            printf("ERROR: Failed to read code lengths from header\n");
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+
+        for (i = 0; i < 8; i++)
+            total_chars |= (uint64_t)header[i] << (8 * i);
+
+        if (!readCodeLengths(header + 8, lens)) {
+            printf("ERROR: Header contains no code lengths\n");
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+
+        assignCanonicalCodes(lens, codes);
+        }
+    else {
+        // Legacy format: character count followed by (character, frequency) pairs
+        memcpy(&size, magic, sizeof(int));
+
+        if (size <= 0 || size > MAX_CHARS) {
+            printf("ERROR: Invalid character count in header: %d\n", size);
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+
+        note("Found %d unique characters in header\n", size);
+
+        unsigned char chars[MAX_CHARS];
+        int freqs[MAX_CHARS];
+
+        for (i = 0; i < size; i++) {
+            if (fread(&chars[i], sizeof(unsigned char), 1, in) != 1 ||
+                fread(&freqs[i], sizeof(int), 1, in) != 1) {
+                printf("ERROR: Failed to read character data from header\n");
+                fclose(in);
+                fclose(out);
+                return 0;
+                }
+            }
+
+        note("Rebuilding Huffman tree...\n");
+
+        // Rebuild Huffman tree
+        uint64_t tree_freqs[MAX_CHARS];
+        for (i = 0; i < size; i++)
+            tree_freqs[i] = (uint64_t)(unsigned)freqs[i];
+        struct HuffmanArena arena;
+        struct MinHeapNode* root = buildHuffmanTree(chars, tree_freqs, size, &arena);
+
+        // Calculate total characters to decode
+        for (i = 0; i < size; i++)
+            total_chars += (unsigned)freqs[i];
+
+        // A single distinct character has an empty code, so no bits were written
+        if (isLeaf(root))
+            single_char = root->data;
+        else
+            collectCodes(root, 0, 0, codes, lens);
+        }
+
+    note("Decompressing %llu characters...\n", (unsigned long long)total_chars);
+
+    unsigned char* in_buffer = (unsigned char*)malloc(IO_BUFFER_SIZE);
+    unsigned char* out_buffer = (unsigned char*)malloc(IO_BUFFER_SIZE);
+    if (in_buffer == NULL || out_buffer == NULL) {
+        printf("ERROR: Memory allocation failed\n");
+        free(in_buffer);
+        free(out_buffer);
+        fclose(in);
+        fclose(out);
+        return 0;
+        }
+
+    double start_time = getTimeSeconds();
+    uint64_t decoded_chars = 0;
+    int ok = 1;
+    progressBegin("Decompressing", total_chars);
+
+    // Reads and writes overlap with decoding on their own threads
+    struct IoRing reader, writer;
+    ioStart(&writer, out, 1);
+
+    if (single_char >= 0) {
+        memset(out_buffer, single_char, IO_BUFFER_SIZE);
+        while (decoded_chars < total_chars) {
+            size_t chunk = IO_BUFFER_SIZE;
+            if (total_chars - decoded_chars < chunk)
+                chunk = (size_t)(total_chars - decoded_chars);
+            ioWrite(&writer, out_buffer, chunk);
+            decoded_chars += chunk;
+            }
+        }
+    else {
+        // Lookup tables replace the tree; the decode loop never walks nodes.
+        // Trained tables were built when they were loaded.
+        struct DecodeTable built;
+        const struct DecodeTable* table = trained ? &trained->decode : &built;
+        uint64_t stage_start = getTimeNs();
+
+        if (trained == NULL && !buildDecodeTable(&built, codes, lens)) {
+            printf("ERROR: Code lengths in header do not form a valid prefix code\n");
+            ioFinish(&writer);
+            free(in_buffer);
+            free(out_buffer);
+            fclose(in);
+            fclose(out);
+            return 0;
+            }
+
+        if (trained == NULL) {
+            statAdd(&codecStats.tables_built, 1);
+            stage_start = stageTime(&codecStats, STAGE_TABLES, stage_start);
+            }
+
+        struct BitReader br;
+        ioStart(&reader, in, 0);
+        initBitReader(&br, &reader, in_buffer);
+
+        while (decoded_chars < total_chars) {
+            size_t chunk = IO_BUFFER_SIZE;
+            if (total_chars - decoded_chars < chunk)
+                chunk = (size_t)(total_chars - decoded_chars);
+
+            if (!decodeSymbols(table, &br, out_buffer, chunk)) {
+                printf("ERROR: Invalid Huffman code in compressed data\n");
+                ok = 0;
+                break;
+                }
+
+            // Bits taken from the zero padding mean the stream was cut short;
+            // a damaged size in the header must not run on past the input
+            if (br.padding * 8 > br.count) {
+                printf("ERROR: Unexpected end of compressed file\n");
+                ok = 0;
+                break;
+                }
+
+            ioWrite(&writer, out_buffer, chunk);
+            decoded_chars += chunk;
+            progressUpdate(decoded_chars);
+            }
+        stageTime(&codecStats, STAGE_CODING, stage_start);
+        ioFinish(&reader);
+        }
+
+    if (!ioFinish(&writer)) {
+        printf("ERROR: Failed to write output file\n");
+        ok = 0;
+        }
+    double elapsed = getTimeSeconds() - start_time;
+
+    if (ok) {
+        statAdd(&codecStats.blocks, 1);
+        statDecompressed(in, decoded_chars);
+        }
+
+    // Close files
+    free(in_buffer);
+    free(out_buffer);
+    fclose(in);
+    fclose(out);
+    if (!ok) {
+        // Same as the mapped path: no partial output of a damaged file
+        if (strcmp(output_file, "-") != 0)
+            unlink(output_file);
+        return 0;
+        }
+
+    note("File decompressed successfully.\n");
+    if (elapsed > 0)
+        note("Decompression throughput: %.2f MB/s\n", decoded_chars / elapsed / 1e6);
+    return 1;
+    }
+
+// Library context: coding options, scratch memory and the last decode table
+struct huff_ctx {
+    struct CodecOptions options;
+    unsigned char* scratch;          // Compressed block before it's copied to dst
+    size_t scratch_size;
+    struct BlockIndexEntry* index;   // Index entries of the buffer being compressed
+    uint64_t index_capacity;
+    struct DecodeCache decode;
+    struct TableCache tables;        // Trained tables loaded into this context
+    struct TrainedTable* table;      // Table that huff_compress codes with, or NULL
+    struct CodecStats stats;         // Counted while huff_ctx_set_stats is on
+    };
+
+// Create a context with the default options. Returns NULL if memory runs out.
+huff_ctx* huff_ctx_create(void)
+    {
+    huff_ctx* ctx = (huff_ctx*)malloc(sizeof(huff_ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->options.max_code_len = MAX_CODE_LEN;
+    ctx->options.streams = 0;
+    ctx->options.ans = 1;
+    ctx->options.context = 0;
+    ctx->options.lz_level = 0;
+    ctx->options.lz_window = DEFAULT_LZ_WINDOW;
+    ctx->options.stats = NULL;
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+    ctx->index = NULL;
+    ctx->index_capacity = 0;
+    ctx->decode.valid = 0;
+    ctx->decode.stats = NULL;
+    ctx->tables.count = 0;
+    ctx->table = NULL;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    return ctx;
+    }
+
+// Release a context and its scratch memory
+void huff_ctx_free(huff_ctx* ctx)
+    {
+    if (ctx == NULL)
+        return;
+    free(ctx->scratch);
+    free(ctx->index);
+    freeTables(&ctx->tables);
+    free(ctx);
+    }
+
+// Set the longest code the compressor may emit
+int huff_ctx_set_max_code_length(huff_ctx* ctx, int bits)
+    {
+    if (ctx == NULL || bits < 1 || bits > MAX_CODE_LEN)
+        return HUFF_ERROR_ARGUMENT;
+    ctx->options.max_code_len = bits;
+    return 0;
+    }
+
+// Turn four-stream blocks on or off
+int huff_ctx_set_streams(huff_ctx* ctx, int enable)
+    {
+    if (ctx == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    ctx->options.streams = enable != 0;
+    return 0;
+    }
+
+// Let blocks use tANS where it comes out smaller, or keep to Huffman codes
+int huff_ctx_set_ans(huff_ctx* ctx, int enable)
+    {
+    if (ctx == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    ctx->options.ans = enable != 0;
+    return 0;
+    }
+
+// Let blocks use order-1 context tables where they come out smaller
+int huff_ctx_set_context(huff_ctx* ctx, int enable)
+    {
+    if (ctx == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    ctx->options.context = enable != 0;
+    return 0;
+    }
+
+// Set the match finder level (0 turns it off) and window; a window of 0
+// keeps the default
+int huff_ctx_set_lz(huff_ctx* ctx, int level, size_t window)
+    {
+    if (ctx == NULL || level < 0 || level > LZ_MAX_LEVEL || window > MAX_BLOCK_SIZE)
+        return HUFF_ERROR_ARGUMENT;
+    ctx->options.lz_level = level;
+    ctx->options.lz_window = window > 0 ? window : DEFAULT_LZ_WINDOW;
+    return 0;
+    }
+
+// Turn stats collection on (clearing the counters) or off
+int huff_ctx_set_stats(huff_ctx* ctx, int enable)
+    {
+    if (ctx == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->options.stats = enable ? &ctx->stats : NULL;
+    ctx->decode.stats = ctx->options.stats;
+    return 0;
+    }
+
+// Copy the counters collected since stats were turned on
+int huff_ctx_get_stats(const huff_ctx* ctx, huff_stats* stats)
+    {
+    if (ctx == NULL || stats == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    stats->bytes_in = ctx->stats.bytes_in;
+    stats->bytes_out = ctx->stats.bytes_out;
+    stats->histogram_ns = ctx->stats.ns[STAGE_HISTOGRAM];
+    stats->match_ns = ctx->stats.ns[STAGE_MATCH];
+    stats->tables_ns = ctx->stats.ns[STAGE_TABLES];
+    stats->coding_ns = ctx->stats.ns[STAGE_CODING];
+    stats->tables_built = ctx->stats.tables_built;
+    stats->blocks = ctx->stats.blocks;
+    return 0;
+    }
+
+// Train a table on a set of samples and write its HUFF_TABLE_SIZE-byte image
+int huff_train(const void* const samples[], const size_t sizes[], size_t count, int max_code_length, void* table)
+    {
+    uint64_t freq[MAX_CHARS] = { 0 };
+
+    if (table == NULL || (samples == NULL && count > 0) || (sizes == NULL && count > 0) ||
+        max_code_length < 1 || max_code_length > MAX_CODE_LEN)
+        return HUFF_ERROR_ARGUMENT;
+
+    for (size_t i = 0; i < count; i++) {
+        if (samples[i] == NULL && sizes[i] > 0)
+            return HUFF_ERROR_ARGUMENT;
+        countBufferFrequency((const unsigned char*)samples[i], sizes[i], freq);
+        }
+    trainTable(freq, max_code_length, (unsigned char*)table);
+    return 0;
+    }
+
+// Load a table image into the context. Returns its ID or an error.
+int64_t huff_ctx_load_table(huff_ctx* ctx, const void* table, size_t size)
+    {
+    if (ctx == NULL || table == NULL)
+        return HUFF_ERROR_ARGUMENT;
+
+    // Tell a bad image apart from a full cache or a failed allocation
+    if (size != TABLE_FILE_SIZE || memcmp(table, TABLE_MAGIC, FORMAT_MAGIC_LEN) != 0)
+        return HUFF_ERROR_FORMAT;
+    struct TrainedTable* loaded = loadTable(&ctx->tables, (const unsigned char*)table, size);
+    if (loaded == NULL)
+        return ctx->tables.count == MAX_TABLES ? HUFF_ERROR_MEMORY : HUFF_ERROR_CORRUPT;
+    return loaded->id;
+    }
+
+// Select the loaded table huff_compress codes with; a negative ID goes back
+// to the block format
+int huff_ctx_use_table(huff_ctx* ctx, int64_t id)
+    {
+    if (ctx == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    if (id < 0) {
+        ctx->table = NULL;
+        return 0;
+        }
+
+    struct TrainedTable* table = id <= UINT32_MAX ? findTable(&ctx->tables, (uint32_t)id) : NULL;
+    if (table == NULL)
+        return HUFF_ERROR_TABLE;
+    ctx->table = table;
+    return 0;
+    }
+
+// Worst case: header, every block at its bound, end byte, index and trailer.
+// This also covers a message coded with a trained table.
+size_t huff_compress_bound(size_t n)
+    {
+    size_t blocks = (n + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    return FORMAT_MAGIC_LEN + 10 + blocks * (BLOCK_HEADER_MAX + BLOCK_BOUND(0)) + 2 * n +
+        1 + INDEX_BOUND(blocks);
+    }
+
+// Compress a buffer into a block-format file image. Blocks are coded into the
+// context's scratch buffer and copied to dst once their size is known.
+static int64_t encodeBuffer(huff_ctx* ctx, const void* src, size_t n, void* dst, size_t cap)
+    {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    uint64_t blocks = (n + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    size_t largest = n < DEFAULT_BLOCK_SIZE ? n : DEFAULT_BLOCK_SIZE;
+    size_t written;
+
+    if (ctx == NULL || (src == NULL && n > 0) || (dst == NULL && cap > 0))
+        return HUFF_ERROR_ARGUMENT;
+
+    // A trained table codes the message straight into dst when it surely fits
+    if (ctx->table != NULL) {
+        if (ctx->options.stats != NULL)
+            statAdd(&ctx->stats.blocks, 1);
+        if (cap >= TABLE_BOUND(n))
+            return (int64_t)compressWithTable(ctx->table, in, n, out);
+
+        unsigned char* packed = (unsigned char*)malloc(TABLE_BOUND(n));
+        if (packed == NULL)
+            return HUFF_ERROR_MEMORY;
+        size_t size = compressWithTable(ctx->table, in, n, packed);
+        if (size <= cap)
+            memcpy(out, packed, size);
+        free(packed);
+        return size <= cap ? (int64_t)size : HUFF_ERROR_DST_TOO_SMALL;
+        }
+
+    if (ctx->scratch_size < BLOCK_BOUND(largest)) {
+        unsigned char* scratch = (unsigned char*)realloc(ctx->scratch, BLOCK_BOUND(largest));
+        if (scratch == NULL)
+            return HUFF_ERROR_MEMORY;
+        ctx->scratch = scratch;
+        ctx->scratch_size = BLOCK_BOUND(largest);
+        }
+    if (ctx->index_capacity < blocks) {
+        struct BlockIndexEntry* index = (struct BlockIndexEntry*)realloc(ctx->index,
+            blocks * sizeof(struct BlockIndexEntry));
+        if (index == NULL)
+            return HUFF_ERROR_MEMORY;
+        ctx->index = index;
+        ctx->index_capacity = blocks;
+        }
+
+    // Header: format magic and nominal block size
+    unsigned char header[FORMAT_MAGIC_LEN + 10];
+    written = FORMAT_MAGIC_LEN;
+    memcpy(header, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN);
+    written += writeVarint(header + written, DEFAULT_BLOCK_SIZE);
+    if (cap < written)
+        return HUFF_ERROR_DST_TOO_SMALL;
+    memcpy(out, header, written);
+
+    for (uint64_t b = 0; b < blocks; b++) {
+        size_t in_size = n - b * DEFAULT_BLOCK_SIZE < DEFAULT_BLOCK_SIZE ? n - b * DEFAULT_BLOCK_SIZE : DEFAULT_BLOCK_SIZE;
+        unsigned char block_header[BLOCK_HEADER_MAX];
+        uint64_t limit_cost;
+        int type, len = 0;
+
+        size_t payload = compressBlock(&ctx->options, in + b * DEFAULT_BLOCK_SIZE, in_size, ctx->scratch,
+            &type, &limit_cost);
+
+        block_header[len++] = (unsigned char)type;
+        len += writeVarint(block_header + len, in_size);
+        len += writeVarint(block_header + len, payload);
+        if (cap - written < len + payload)
+            return HUFF_ERROR_DST_TOO_SMALL;
+
+        memcpy(out + written, block_header, len);
+        memcpy(out + written + len, ctx->scratch, payload);
+        written += len + payload;
+        ctx->index[b].size = len + payload;
+        ctx->index[b].original_size = in_size;
+        }
+
+    // The scratch buffer always has room for the index of this many blocks
+    size_t index_size = packBlockIndex(ctx->scratch, ctx->index, blocks, written + 1);
+    if (cap - written < 1 + index_size)
+        return HUFF_ERROR_DST_TOO_SMALL;
+    out[written++] = BLOCK_END;
+    memcpy(out + written, ctx->scratch, index_size);
+    written += index_size;
+    return (int64_t)written;
+    }
+
+// Walk a compressed buffer, decoding it into dst when ctx is given or only
+// adding up the block sizes otherwise. Returns the original size or an error.
+static int64_t decodeBuffer(huff_ctx* ctx, const unsigned char* src, size_t size, unsigned char* dst, size_t cap)
+    {
+    const unsigned char* pos = src + FORMAT_MAGIC_LEN;
+    const unsigned char* end = src + size;
+    uint64_t total = 0, block_size;
+
+    if (src == NULL || size < FORMAT_MAGIC_LEN)
+        return HUFF_ERROR_FORMAT;
+
+    // Version 2 is one Huffman payload behind the original size
+    if (memcmp(src, FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        if (size < HEADER_SIZE)
+            return HUFF_ERROR_CORRUPT;
+        for (int i = 0; i < 8; i++)
+            total |= (uint64_t)src[FORMAT_MAGIC_LEN + i] << (8 * i);
+        if (total > INT64_MAX)
+            return HUFF_ERROR_CORRUPT;
+        if (ctx == NULL || total == 0)
+            return (int64_t)total;
+        if (total > cap)
+            return HUFF_ERROR_DST_TOO_SMALL;
+        if (!decompressBlockCached(&ctx->decode, BLOCK_HUFFMAN, pos + 8, end - pos - 8, dst, total))
+            return HUFF_ERROR_CORRUPT;
+        return (int64_t)total;
+        }
+
+    // Version 4 is a bitstream coded with a table loaded into the context
+    if (memcmp(src, TABLE_FORMAT_MAGIC, FORMAT_MAGIC_LEN) == 0) {
+        uint32_t id = 0;
+        if (size < FORMAT_MAGIC_LEN + 4)
+            return HUFF_ERROR_CORRUPT;
+        for (int i = 0; i < 4; i++)
+            id |= (uint32_t)*pos++ << (8 * i);
+        if (!readVarint(&pos, end, &total) || total > INT64_MAX)
+            return HUFF_ERROR_CORRUPT;
+        if (ctx == NULL || total == 0)
+            return (int64_t)total;
+
+        const struct TrainedTable* table = findTable(&ctx->tables, id);
+        struct BitReader br;
+        if (table == NULL)
+            return HUFF_ERROR_TABLE;
+        if (total > cap)
+            return HUFF_ERROR_DST_TOO_SMALL;
+        if (ctx->options.stats != NULL)
+            statAdd(&ctx->stats.blocks, 1);
+        initBitReaderMemory(&br, pos, end - pos);
+        if (!decodeSymbols(&table->decode, &br, dst, total) || br.padding * 8 > br.count)
+            return HUFF_ERROR_CORRUPT;
+        return (int64_t)total;
+        }
+
+    if (memcmp(src, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN) != 0)
+        return HUFF_ERROR_FORMAT;
+    if (!readVarint(&pos, end, &block_size) || block_size == 0 || block_size > MAX_BLOCK_SIZE)
+        return HUFF_ERROR_CORRUPT;
+
+    // The blocks run up to the end byte; the index after it isn't needed here
+    while (1) {
+        uint64_t n, payload;
+
+        if (pos == end)
+            return HUFF_ERROR_CORRUPT;
+        int type = *pos++;
+        if (type == BLOCK_END)
+            return (int64_t)total;
+
+        if (!readVarint(&pos, end, &n) || !readVarint(&pos, end, &payload) ||
+            n == 0 || n > block_size || payload > (uint64_t)(end - pos))
+            return HUFF_ERROR_CORRUPT;
+
+        if (ctx != NULL) {
+            if (n > cap - total)
+                return HUFF_ERROR_DST_TOO_SMALL;
+            int status = decompressBlockCached(&ctx->decode, type, pos, payload, dst + total, n);
+            if (status <= 0)
+                return status < 0 ? status : HUFF_ERROR_CORRUPT;
+            }
+        pos += payload;
+        total += n;
+        }
+    }
+
+// Compress a buffer, counting its sizes when stats are on
+int64_t huff_compress(huff_ctx* ctx, const void* src, size_t n, void* dst, size_t cap)
+    {
+    int64_t size = encodeBuffer(ctx, src, n, dst, cap);
+    if (size >= 0 && ctx->options.stats != NULL) {
+        ctx->stats.bytes_in += n;
+        ctx->stats.bytes_out += (uint64_t)size;
+        }
+    return size;
+    }
+
+// Original size of a compressed buffer, read from its headers
+int64_t huff_decompressed_size(const void* src, size_t size)
+    {
+    return decodeBuffer(NULL, (const unsigned char*)src, size, NULL, 0);
+    }
+
+// Decompress a version 2, 3 or 4 buffer into dst
+int64_t huff_decompress(huff_ctx* ctx, const void* src, size_t size, void* dst, size_t cap)
+    {
+    if (ctx == NULL || (dst == NULL && cap > 0))
+        return HUFF_ERROR_ARGUMENT;
+
+    int64_t total = decodeBuffer(ctx, (const unsigned char*)src, size, (unsigned char*)dst, cap);
+    if (total >= 0 && ctx->options.stats != NULL) {
+        ctx->stats.bytes_in += size;
+        ctx->stats.bytes_out += (uint64_t)total;
+        }
+    return total;
+    }
+
+// Range reader: a compressed block-format file (mapped, or a caller's
+// buffer), its block index and the blocks decoded last
+struct huff_reader {
+    const unsigned char* data;
+    size_t size;
+    int mapped;                      // data is a mapping to release on close
+    struct BlockIndexEntry* index;
+    uint64_t count;
+    uint64_t block_size;
+    uint64_t largest;                // Largest original block size in the index
+    uint64_t total;                  // Original size
+    struct DecodeCache decode;
+    struct CachedBlock cache[RANGE_CACHE_BLOCKS];
+    uint64_t clock;                  // Counts block uses, for least recently used
+    };
+
+// Set up a reader over a block-format buffer. Returns 0 or an error.
+static int openReader(const unsigned char* data, size_t size, int mapped, huff_reader** reader)
+    {
+    const unsigned char* pos = data + FORMAT_MAGIC_LEN;
+    uint64_t block_size, count;
+
+    if (size < FORMAT_MAGIC_LEN || memcmp(data, BLOCK_FORMAT_MAGIC, FORMAT_MAGIC_LEN) != 0)
+        return HUFF_ERROR_FORMAT;
+    if (!readVarint(&pos, data + size, &block_size) || block_size == 0 || block_size > MAX_BLOCK_SIZE)
+        return HUFF_ERROR_CORRUPT;
+
+    struct BlockIndexEntry* index = parseBlockIndex(data, size, size, pos - data, &count);
+    if (index == NULL)
+        return HUFF_ERROR_CORRUPT;
+
+    // Buffers are sized from the blocks actually present, not the nominal
+    // block size a header can claim; no block may exceed that size either
+    uint64_t largest = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (index[i].original_size > block_size) {
+            free(index);
+            return HUFF_ERROR_CORRUPT;
+            }
+        if (index[i].original_size > largest)
+            largest = index[i].original_size;
+        }
+
+    huff_reader* r = (huff_reader*)malloc(sizeof(huff_reader));
+    if (r == NULL) {
+        free(index);
+        return HUFF_ERROR_MEMORY;
+        }
+
+    r->data = data;
+    r->size = size;
+    r->mapped = mapped;
+    r->index = index;
+    r->count = count;
+    r->block_size = block_size;
+    r->largest = largest;
+    r->total = count ? index[count - 1].original_offset + index[count - 1].original_size : 0;
+    r->decode.valid = 0;
+    r->decode.stats = NULL;
+    for (int i = 0; i < RANGE_CACHE_BLOCKS; i++) {
+        r->cache[i].data = NULL;
+        r->cache[i].block = UINT64_MAX;
+        r->cache[i].used = 0;
+        }
+    r->clock = 0;
+    *reader = r;
+    return 0;
+    }
+
+// Open a compressed file for range reads, mapping it into memory
+int huff_reader_open(const char* path, huff_reader** reader)
+    {
+    struct stat st;
+
+    if (path == NULL || reader == NULL)
+        return HUFF_ERROR_ARGUMENT;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return HUFF_ERROR_IO;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return HUFF_ERROR_IO;
+        }
+    if (st.st_size == 0) {
+        close(fd);
+        return HUFF_ERROR_FORMAT;
+        }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return HUFF_ERROR_IO;
+
+    // Reads jump to the blocks they need instead of streaming through
+    madvise(data, (size_t)st.st_size, MADV_RANDOM);
+    int status = openReader((const unsigned char*)data, (size_t)st.st_size, 1, reader);
+    if (status < 0)
+        munmap(data, (size_t)st.st_size);
+    return status;
+    }
+
+// Open a compressed buffer for range reads; the buffer must outlive the reader
+int huff_reader_open_buffer(const void* src, size_t size, huff_reader** reader)
+    {
+    if (src == NULL || reader == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    return openReader((const unsigned char*)src, size, 0, reader);
+    }
+
+// Release a reader, its cached blocks and its mapping
+void huff_reader_close(huff_reader* reader)
+    {
+    if (reader == NULL)
+        return;
+    for (int i = 0; i < RANGE_CACHE_BLOCKS; i++)
+        free(reader->cache[i].data);
+    if (reader->mapped)
+        munmap((void*)reader->data, reader->size);
+    free(reader->index);
+    free(reader);
+    }
+
+// Original size of the data behind a reader
+int64_t huff_reader_size(const huff_reader* reader)
+    {
+    if (reader == NULL)
+        return HUFF_ERROR_ARGUMENT;
+    return (int64_t)reader->total;
+    }
+
+// Index of the block holding original byte offset (< total): the last block
+// that starts at or before it
+static uint64_t findBlock(const huff_reader* r, uint64_t offset)
+    {
+    uint64_t lo = 0, hi = r->count - 1;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo + 1) / 2;
+        if (r->index[mid].original_offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+        }
+    return lo;
+    }
+
+// Decoded bytes of block b from the cache, decoding it into the least
+// recently used slot on a miss. Returns 0 or an error.
+static int cachedBlock(huff_reader* r, uint64_t b, const unsigned char** data)
+    {
+    struct CachedBlock* slot = &r->cache[0];
+
+    for (int i = 0; i < RANGE_CACHE_BLOCKS; i++) {
+        if (r->cache[i].block == b) {
+            slot = &r->cache[i];
+            slot->used = ++r->clock;
+            *data = slot->data;
+            return 0;
+            }
+        if (r->cache[i].used < slot->used)
+            slot = &r->cache[i];
+        }
+
+    if (slot->data == NULL) {
+        slot->data = (unsigned char*)malloc(r->largest);
+        if (slot->data == NULL)
+            return HUFF_ERROR_MEMORY;
+        }
+
+    // A failed decode leaves the slot empty rather than half written
+    slot->block = UINT64_MAX;
+    slot->used = 0;
+    int status = decodeBlockRecord(&r->decode, r->data + r->index[b].offset, &r->index[b], r->block_size,
+        slot->data);
+    if (status <= 0)
+        return status < 0 ? status : HUFF_ERROR_CORRUPT;
+    slot->block = b;
+    slot->used = ++r->clock;
+    *data = slot->data;
+    return 0;
+    }
+
+// Copy original bytes [offset, offset + len) into dst. Blocks the range
+// covers whole are decoded straight into dst; the partly covered ones at its
+// ends go through the cache, where the next nearby read finds them.
+int64_t huff_reader_read(huff_reader* reader, uint64_t offset, void* dst, size_t len)
+    {
+    unsigned char* out = (unsigned char*)dst;
+
+    if (reader == NULL || (dst == NULL && len > 0))
+        return HUFF_ERROR_ARGUMENT;
+    if (offset >= reader->total)
+        return 0;
+    if (len > reader->total - offset)
+        len = (size_t)(reader->total - offset);
+    if (len > INT64_MAX)
+        len = INT64_MAX;
+
+    uint64_t b = findBlock(reader, offset);
+    size_t done = 0;
+
+    for (; done < len; b++) {
+        const struct BlockIndexEntry* e = &reader->index[b];
+        uint64_t skip = offset + done - e->original_offset;
+        size_t take = e->original_size - skip < len - done ? (size_t)(e->original_size - skip) : len - done;
+        int cached = 0;
+
+        for (int i = 0; i < RANGE_CACHE_BLOCKS; i++)
+            cached |= reader->cache[i].block == b;
+
+        if (take == e->original_size && !cached) {
+            int status = decodeBlockRecord(&reader->decode, reader->data + e->offset, e, reader->block_size,
+                out + done);
+            if (status <= 0)
+                return status < 0 ? status : HUFF_ERROR_CORRUPT;
+            }
+        else {
+            const unsigned char* block;
+            int status = cachedBlock(reader, b, &block);
+            if (status < 0)
+                return status;
+            memcpy(out + done, block + skip, take);
+            }
+        done += take;
+        }
+    return (int64_t)len;
+    }
+
+// Describe a library return code
+const char* huff_error_name(int64_t code)
+    {
+    if (code >= 0)
+        return "no error";
+    if (code == HUFF_ERROR_MEMORY)
+        return "out of memory";
+    if (code == HUFF_ERROR_DST_TOO_SMALL)
+        return "destination buffer too small";
+    if (code == HUFF_ERROR_CORRUPT)
+        return "corrupt compressed data";
+    if (code == HUFF_ERROR_FORMAT)
+        return "unknown format";
+    if (code == HUFF_ERROR_ARGUMENT)
+        return "invalid argument";
+    if (code == HUFF_ERROR_TABLE)
+        return "trained table not loaded";
+    if (code == HUFF_ERROR_IO)
+        return "cannot open or map file";
+    return "unknown error";
+    }
+
+// Decompress original bytes [offset, offset + length) of a block-format file
+// (-R), decoding only the blocks that cover them; the range is cut at the
+// end of the data. Returns 1 on success.
+int decompressRange(const char* input_file, const char* output_file, uint64_t offset, uint64_t length)
+    {
+    huff_reader* reader;
+
+    note("Opening input file: %s\n", input_file);
+    if (strcmp(input_file, "-") == 0) {
+        printf("ERROR: -R needs a compressed file it can map, not a pipe\n");
+        return 0;
+        }
+    int status = huff_reader_open(input_file, &reader);
+    if (status == HUFF_ERROR_IO) {
+        printf("Error opening input file\n");
+        return 0;
+        }
+    if (status == HUFF_ERROR_FORMAT) {
+        printf("ERROR: Only block-format files (compressed with -b or -T) can be read by range\n");
+        return 0;
+        }
+    if (status < 0) {
+        printf("ERROR: Cannot read block index: %s\n", huff_error_name(status));
+        return 0;
+        }
+    reader->decode.stats = &codecStats;
+
+    FILE* out = openOutput(output_file);
+    unsigned char* buffer = (unsigned char*)malloc(reader->largest + 1);
+    if (out == NULL || buffer == NULL) {
+        printf(out == NULL ? "Error opening output file\n" : "ERROR: Memory allocation failed\n");
+        if (out != NULL)
+            fclose(out);
+        free(buffer);
+        huff_reader_close(reader);
+        return 0;
+        }
+
+    if (offset > reader->total)
+        offset = reader->total;
+    if (length > reader->total - offset)
+        length = reader->total - offset;
+    note("Decompressing bytes %llu to %llu of %llu...\n", (unsigned long long)offset,
+        (unsigned long long)(offset + length), (unsigned long long)reader->total);
+    progressBegin("Decompressing", length);
+
+    // One read per block, so blocks in the middle decode straight into the buffer
+    uint64_t done = 0;
+    int ok = 1;
+    while (done < length && ok) {
+        const struct BlockIndexEntry* e = &reader->index[findBlock(reader, offset + done)];
+        uint64_t take = e->original_offset + e->original_size - (offset + done);
+        if (take > length - done)
+            take = length - done;
+
+        int64_t got = huff_reader_read(reader, offset + done, buffer, (size_t)take);
+        ok = got == (int64_t)take && fwrite(buffer, 1, (size_t)take, out) == take;
+        if (got < 0)
+            printf("ERROR: %s in block %llu\n", huff_error_name(got), (unsigned long long)(e - reader->index));
+        else if (!ok)
+            printf("ERROR: Failed to write output\n");
+        statAdd(&codecStats.bytes_in, e->size);
+        done += take;
+        progressUpdate(done);
+        }
+    statAdd(&codecStats.bytes_out, done);
+
+    if (fclose(out) != 0 && ok) {
+        printf("ERROR: Failed to write output\n");
+        ok = 0;
+        }
+    free(buffer);
+    huff_reader_close(reader);
+    if (ok)
+        note("Range decompressed successfully.\n");
+    return ok;
+    }
+
+// Fill a buffer with text-like bytes: words from a small vocabulary with
+// Zipf-like repetition, separated by spaces and occasional line breaks
+void fillTextSample(unsigned char* buf, size_t n, uint32_t seed)
+    {
+    static const char* words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was",
+        "with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from",
+        "at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+        "compression", "Huffman", "frequency", "table", "block", "stream", "decoder"
+    };
+    const int num_words = (int)(sizeof(words) / sizeof(words[0]));
+    size_t i = 0;
+
+    while (i < n) {
+        // The smaller of two uniform picks favours the common words
+        seed = seed * 1103515245u + 12345u;
+        int a = (int)((seed >> 16) % num_words);
+        seed = seed * 1103515245u + 12345u;
+        int b = (int)((seed >> 16) % num_words);
+        const char* w = words[a < b ? a : b];
+        for (; *w && i < n; w++)
+            buf[i++] = (unsigned char)*w;
+        if (i < n)
+            buf[i++] = (seed >> 8) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+
+// Fill a buffer with low-entropy bytes: long zero runs broken by a few small
+// values, like sparse binary records
+void fillLowEntropySample(unsigned char* buf, size_t n, uint32_t seed)
+    {
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = (seed >> 16) % 16 == 0 ? (unsigned char)((seed >> 24) & 7) : 0;
+        }
+    }
 
-    // Count frequency of each character
-    countFrequency(in, freq, &fileSize);
+// Time one histogram kernel on a buffer; returns the best of benchRuns in GB/s.
+// kernel 0 is the plain one-counter loop, 1 the interleaved tables, 2 the
+// threaded histogram.
+double benchmarkHistogramKernel(int kernel, const unsigned char* data, size_t size, uint64_t freq[])
+    {
+    double best = 0;
 
-    // Create array of characters and their frequencies
-    unsigned char chars[MAX_CHARS];
-    int freq_list[MAX_CHARS];
-    int size = 0;
+    for (int run = 0; run < benchRuns; run++) {
+        memset(freq, 0, MAX_CHARS * sizeof(uint64_t));
+        double start = getTimeSeconds();
+        if (kernel == 0) {
+            for (size_t i = 0; i < size; i++)
+                freq[data[i]]++;
+            }
+        else if (kernel == 1) {
+            countBufferFrequency(data, size, freq);
+            }
+        else {
+            countFrequencyParallel(data, size, freq, numThreads);
+            }
+        double elapsed = getTimeSeconds() - start;
+        if (elapsed > 0 && size / elapsed / 1e9 > best)
+            best = size / elapsed / 1e9;
+        }
+    return best;
+    }
 
-    printf("Building character frequency list...\n");
-    for (i = 0; i < MAX_CHARS; i++) {
-        if (freq[i] > 0) {
-            chars[size] = i;
-            freq_list[size] = freq[i];
-            size++;
+// Histogram micro-benchmark (-H): synthetic text and low-entropy inputs plus
+// any files named on the command line
+int benchmarkHistogram(int count, char* files[])
+    {
+    static const char* kernel_names[] = { "1 table", "4 tables", "threads" };
+    int kernels = numThreads > 1 ? 3 : 2;
+    int status = 0;
+
+    printf("%-24s %12s", "input", "bytes");
+    for (int k = 0; k < kernels; k++)
+        printf(" %10s", kernel_names[k]);
+    printf("   (histogram GB/s, best of %d)\n", benchRuns);
+
+    for (int input = 0; input < 2 + count; input++) {
+        struct MappedFile map = { NULL, 0 };
+        const char* name = input == 0 ? "synthetic text" : input == 1 ? "synthetic low-entropy" : files[input - 2];
+        unsigned char* data;
+        size_t size = BENCH_SAMPLE_SIZE;
+
+        if (input < 2) {
+            data = (unsigned char*)malloc(size);
+            if (data == NULL) {
+                printf("ERROR: Failed to allocate benchmark input\n");
+                return 1;
+                }
+            if (input == 0)
+                fillTextSample(data, size, 1);
+            else
+                fillLowEntropySample(data, size, 1);
+            }
+        else {
+            FILE* f = fopen(name, "rb");
+            if (f == NULL || !mapInputFile(f, &map)) {
+                printf("ERROR: Cannot map %s\n", name);
+                if (f != NULL)
+                    fclose(f);
+                status = 1;
+                continue;
+                }
+            fclose(f);
+            data = map.data;
+            size = map.size;
+            }
+
+        uint64_t reference[MAX_CHARS], freq[MAX_CHARS];
+        printf("%-24s %12zu", name, size);
+        for (int k = 0; k < kernels; k++) {
+            double rate = benchmarkHistogramKernel(k, data, size, k == 0 ? reference : freq);
+            if (k > 0 && memcmp(reference, freq, sizeof(freq)) != 0) {
+                printf(" %10s", "MISMATCH");
+                status = 1;
+                }
+            else {
+                printf(" %10.2f", rate);
+                }
             }
+        printf("\n");
+
+        if (map.data != NULL)
+            unmapFile(&map);
+        else
+            free(data);
         }
+    return status;
+    }
 
-    printf("Found %d unique characters\n", size);
+// Fill a buffer with uniformly random bytes
+void fillRandomSample(unsigned char* buf, size_t n, uint32_t seed)
+    {
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = (unsigned char)(seed >> 16);
+        }
+    }
 
-    // Check if the file has any content
-    if (size == 0 || fileSize == 0) {
-        printf("ERROR: The input file is empty or no valid characters were found\n");
-        fclose(in);
-        return;
+// Fill a buffer with geometrically skewed bytes: value k appears with
+// probability 2^-(k+1), so the optimal code is deeper than MAX_CODE_LEN
+void fillSkewedSample(unsigned char* buf, size_t n, uint32_t seed)
+    {
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = (unsigned char)__builtin_ctz(~(seed >> 16));
         }
+    }
 
-    // Create and store Huffman codes
-    char* huffmanCodes[MAX_CHARS] = { NULL };
-    HuffmanCodes(chars, freq_list, size, huffmanCodes);
+// Peak resident set size of the process in KB
+long peakRssKb(void)
+    {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;
+    }
 
-    printf("Opening output file: %s\n", output_file);
+// Run every stage once on one input, keeping the fastest time of each stage
+// in r. Returns 0 if a round trip doesn't reproduce the input.
+int benchmarkStages(struct BenchState* st, const unsigned char* data, size_t size, struct BenchResult* r)
+    {
+    double t;
+    int ok = 1;
 
-    // Open output file
-    out = fopen(output_file, "wb");
-    if (out == NULL) {
-        printf("Error opening output file\n");
-        fclose(in);
-        return;
+    // Histogram of every block
+    t = getTimeSeconds();
+    for (size_t b = 0; b < st->blocks; b++) {
+        size_t off = b * DEFAULT_BLOCK_SIZE;
+        memset(st->freq[b], 0, sizeof(st->freq[b]));
+        countBufferFrequency(data + off, size - off < DEFAULT_BLOCK_SIZE ? size - off : DEFAULT_BLOCK_SIZE, st->freq[b]);
         }
+    benchKeep(&r->histogram, getTimeSeconds() - t);
 
-    printf("Output file opened successfully\n");
-    printf("Writing compressed data header...\n");
+    // Code lengths, canonical codes and encode tables
+    t = getTimeSeconds();
+    for (size_t b = 0; b < st->blocks; b++) {
+        unsigned char chars[MAX_CHARS];
+        uint64_t freq_list[MAX_CHARS], codes[MAX_CHARS], limit_cost;
+        int symbols = 0;
 
-    // Write header: number of unique characters and their frequencies
-    fwrite(&size, sizeof(int), 1, out);
-    for (i = 0; i < size; i++) {
-        fwrite(&chars[i], sizeof(unsigned char), 1, out);
-        fwrite(&freq_list[i], sizeof(int), 1, out);
+        for (int i = 0; i < MAX_CHARS; i++) {
+            if (st->freq[b][i] > 0) {
+                chars[symbols] = i;
+                freq_list[symbols++] = st->freq[b][i];
+                }
+            }
+        buildCodeLengths(chars, freq_list, symbols, maxCodeLength, st->lens[b], &limit_cost);
+        assignCanonicalCodes(st->lens[b], codes);
+        buildEncodeTable(&st->encode[b], codes, st->lens[b]);
         }
+    benchKeep(&r->build, getTimeSeconds() - t);
 
-    // Compress and write data
-    printf("Compressing data...\n");
-    rewind(in);
+    // Encode every block into its own bitstream
+    t = getTimeSeconds();
+    for (size_t b = 0; b < st->blocks; b++) {
+        size_t off = b * DEFAULT_BLOCK_SIZE;
+        struct BitWriter bw;
 
-    // Use a buffer for more efficient reading
-    const int BUFFER_SIZE = 8192;  // 8KB buffer
-    unsigned char read_buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    long total_read = 0;
+        initBitWriter(&bw, NULL, st->packed + b * BLOCK_BOUND(DEFAULT_BLOCK_SIZE));
+        encodeSymbols(&st->encode[b], &bw, data + off, size - off < DEFAULT_BLOCK_SIZE ? size - off : DEFAULT_BLOCK_SIZE);
+        st->packed_size[b] = finishBitWriter(&bw);
+        }
+    benchKeep(&r->encode, getTimeSeconds() - t);
 
-    unsigned char bit_buffer = 0;
-    int bit_position = 0;
-    int total_bytes = 0;
-    int progress = 0;
+    // Decode tables from the code lengths
+    t = getTimeSeconds();
+    for (size_t b = 0; b < st->blocks; b++) {
+        uint64_t codes[MAX_CHARS];
+        assignCanonicalCodes(st->lens[b], codes);
+        if (!buildDecodeTable(&st->decode[b], codes, st->lens[b]))
+            return 0;
+        }
+    benchKeep(&r->decode_build, getTimeSeconds() - t);
 
-    while ((bytes_read = fread(read_buffer, 1, BUFFER_SIZE, in)) > 0) {
-        for (size_t k = 0; k < bytes_read; k++) {
-            ch = read_buffer[k];
+    // Decode every bitstream
+    t = getTimeSeconds();
+    for (size_t b = 0; b < st->blocks; b++) {
+        size_t off = b * DEFAULT_BLOCK_SIZE;
+        struct BitReader br;
 
-            len = strlen(huffmanCodes[ch]);
-            for (j = 0; j < len; j++) {
-                if (huffmanCodes[ch][j] == '1')
-                    bit_buffer |= (1 << bit_position);
+        initBitReaderMemory(&br, st->packed + b * BLOCK_BOUND(DEFAULT_BLOCK_SIZE), st->packed_size[b]);
+        ok &= decodeSymbols(&st->decode[b], &br, st->decoded + off,
+            size - off < DEFAULT_BLOCK_SIZE ? size - off : DEFAULT_BLOCK_SIZE);
+        }
+    benchKeep(&r->decode, getTimeSeconds() - t);
+    ok = ok && memcmp(st->decoded, data, size) == 0;
 
-                bit_position++;
+    // Whole round trip through the library, with the command line's -l and -4
+    memset(st->decoded, 0, size);
+    t = getTimeSeconds();
+    int64_t compressed = huff_compress(st->ctx, data, size, st->compressed, huff_compress_bound(size));
+    benchKeep(&r->compress, getTimeSeconds() - t);
+    if (compressed < 0)
+        return 0;
+    r->compressed = (uint64_t)compressed;
 
-                if (bit_position == 8) {
-                    fwrite(&bit_buffer, sizeof(unsigned char), 1, out);
-                    total_bytes++;
-                    bit_buffer = 0;
-                    bit_position = 0;
-                    }
-                }
-            }
+    t = getTimeSeconds();
+    int64_t decompressed = huff_decompress(st->ctx, st->compressed, (size_t)compressed, st->decoded, size);
+    benchKeep(&r->decompress, getTimeSeconds() - t);
+    ok = ok && decompressed == (int64_t)size && memcmp(st->decoded, data, size) == 0;
 
-        total_read += bytes_read;
-        int new_progress = (total_read * 100) / fileSize;
+    // File I/O: write the compressed image to a temporary file and read it back
+    FILE* tmp = tmpfile();
+    if (tmp != NULL) {
+        t = getTimeSeconds();
+        size_t moved = fwrite(st->compressed, 1, (size_t)compressed, tmp);
+        fflush(tmp);
+        rewind(tmp);
+        moved += fread(st->compressed, 1, (size_t)compressed, tmp);
+        benchKeep(&r->io, getTimeSeconds() - t);
+        fclose(tmp);
+        ok = ok && moved == 2 * (size_t)compressed;
+        }
+
+    return ok;
+    }
+
+// Keep the faster of a stage's best time so far and a new measurement
+void benchKeep(double* best, double elapsed)
+    {
+    if (*best <= 0 || elapsed < *best)
+        *best = elapsed;
+    }
+
+// Throughput in MB/s of size bytes processed in the given time
+double benchRate(size_t size, double elapsed)
+    {
+    return elapsed > 0 ? size / elapsed / 1e6 : 0;
+    }
+
+// Benchmark one input over benchRuns runs, print a result row and append a
+// JSON line to json if given. Returns 0 if the input failed to round-trip.
+int benchmarkInput(const char* name, const unsigned char* data, size_t size, FILE* json)
+    {
+    struct BenchState st;
+    struct BenchResult r;
+    int ok = 1;
+
+    memset(&st, 0, sizeof(st));
+    memset(&r, 0, sizeof(r));
+    st.blocks = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    st.ctx = huff_ctx_create();
+    st.freq = (uint64_t(*)[MAX_CHARS])malloc((st.blocks + 1) * sizeof(*st.freq));
+    st.lens = (int(*)[MAX_CHARS])malloc((st.blocks + 1) * sizeof(*st.lens));
+    st.encode = (struct EncodeTable*)malloc((st.blocks + 1) * sizeof(struct EncodeTable));
+    st.decode = (struct DecodeTable*)malloc((st.blocks + 1) * sizeof(struct DecodeTable));
+    st.packed = (unsigned char*)malloc((st.blocks + 1) * BLOCK_BOUND(DEFAULT_BLOCK_SIZE));
+    st.packed_size = (size_t*)malloc((st.blocks + 1) * sizeof(size_t));
+    st.compressed = (unsigned char*)malloc(huff_compress_bound(size));
+    st.decoded = (unsigned char*)malloc(size + 1);
+
+    if (st.ctx == NULL || st.freq == NULL || st.lens == NULL || st.encode == NULL || st.decode == NULL ||
+        st.packed == NULL || st.packed_size == NULL || st.compressed == NULL || st.decoded == NULL) {
+        printf("ERROR: Not enough memory to benchmark %s\n", name);
+        ok = 0;
+        }
+    else {
+        huff_ctx_set_max_code_length(st.ctx, maxCodeLength);
+        huff_ctx_set_streams(st.ctx, useStreams);
+        huff_ctx_set_ans(st.ctx, useAns);
+        huff_ctx_set_context(st.ctx, useContext);
+        huff_ctx_set_lz(st.ctx, lzLevel, lzWindow);
+        for (int run = 0; run < benchRuns && ok; run++)
+            ok = benchmarkStages(&st, data, size, &r);
+        }
+
+    long rss = peakRssKb();
+    double ratio = size > 0 ? (double)r.compressed / size : 0;
+
+    if (ok) {
+        printf("%-26s %10zu %6.3f %8.0f %8.2f %8.0f %8.2f %8.0f %8.0f %8.0f %8.0f %8.1f\n", name, size, ratio,
+            benchRate(size, r.histogram), r.build * 1e3, benchRate(size, r.encode), r.decode_build * 1e3,
+            benchRate(size, r.decode), benchRate(size, r.io), benchRate(size, r.compress),
+            benchRate(size, r.decompress), rss / 1024.0);
+        }
+    else if (st.decoded != NULL) {
+        printf("%-26s %10zu FAILED round trip\n", name, size);
+        }
 
-        if (new_progress / 10 > progress / 10) {
-            progress = new_progress;
-            printf("Compression progress: %d%% complete\n", progress);
+    if (json != NULL) {
+        fprintf(json, "{\"input\":\"");
+        for (const char* c = name; *c; c++) {
+            if (*c == '"' || *c == '\\')
+                fputc('\\', json);
+            fputc(*c, json);
             }
+        fprintf(json, "\",\"bytes\":%zu,\"compressed\":%llu,\"ratio\":%.6f,\"ok\":%s,\"runs\":%d,"
+            "\"block_size\":%zu,\"max_code_len\":%d,\"streams\":%d,\"kernels\":\"%s\","
+            "\"histogram_mbps\":%.2f,\"table_build_ms\":%.4f,\"encode_mbps\":%.2f,"
+            "\"decode_table_build_ms\":%.4f,\"decode_mbps\":%.2f,\"io_mbps\":%.2f,"
+            "\"compress_mbps\":%.2f,\"decompress_mbps\":%.2f,\"peak_rss_kb\":%ld}\n",
+            size, (unsigned long long)r.compressed, ratio, ok ? "true" : "false", benchRuns,
+            DEFAULT_BLOCK_SIZE, maxCodeLength, useStreams ? STREAM_COUNT : 1, kernels->name,
+            benchRate(size, r.histogram), r.build * 1e3, benchRate(size, r.encode),
+            r.decode_build * 1e3, benchRate(size, r.decode), benchRate(size, r.io),
+            benchRate(size, r.compress), benchRate(size, r.decompress), rss);
         }
 
-    // Write remaining bits if any
-    if (bit_position > 0) {
-        fwrite(&bit_buffer, sizeof(unsigned char), 1, out);
-        total_bytes++;
+    huff_ctx_free(st.ctx);
+    free(st.freq);
+    free(st.lens);
+    free(st.encode);
+    free(st.decode);
+    free(st.packed);
+    free(st.packed_size);
+    free(st.compressed);
+    free(st.decoded);
+    return ok;
+    }
+
+// Benchmark harness (-B): synthetic text, random and skewed inputs at several
+// sizes, then every file named on the command line. Results go to stdout and,
+// with -j, to a JSON Lines file with one object per input.
+int benchmarkCorpus(int count, char* files[])
+    {
+    static const size_t sizes[] = { (size_t)64 << 10, (size_t)1 << 20, (size_t)16 << 20 };
+    static const char* kinds[] = { "text", "random", "skewed" };
+    FILE* json = NULL;
+    int status = 0;
+
+    if (jsonPath != NULL) {
+        json = fopen(jsonPath, "w");
+        if (json == NULL) {
+            printf("ERROR: Cannot write results to %s\n", jsonPath);
+            return 1;
+            }
         }
 
-    // Close files
-    fclose(in);
-    fclose(out);
+    printf("Best of %d runs with %s kernels. Stage columns are MB/s except table builds (ms).\n", benchRuns,
+        kernels->name);
+    printf("%-26s %10s %6s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "input", "bytes", "ratio", "histo",
+        "build", "encode", "dbuild", "decode", "io", "comp", "decomp", "rss MB");
 
-    // Free allocated memory for codes
-    for (i = 0; i < MAX_CHARS; i++)
-        if (huffmanCodes[i] != NULL)
-            free(huffmanCodes[i]);
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < 3; i++) {
+            char name[64];
+            unsigned char* data = (unsigned char*)malloc(sizes[i]);
+            if (data == NULL) {
+                printf("ERROR: Failed to allocate benchmark input\n");
+                status = 1;
+                continue;
+                }
 
-    printf("File compressed successfully.\n");
-    printf("Original size: %ld bytes\n", fileSize);
-    int header_size = sizeof(int) + (size * (sizeof(unsigned char) + sizeof(int)));
-    int compressed_size = total_bytes + header_size;
-    printf("Compressed size: %d bytes (Header: %d bytes, Data: %d bytes)\n",
-        compressed_size, header_size, total_bytes);
+            if (k == 0)
+                fillTextSample(data, sizes[i], 1);
+            else if (k == 1)
+                fillRandomSample(data, sizes[i], 1);
+            else
+                fillSkewedSample(data, sizes[i], 1);
 
-    if (fileSize > 0) {
-        float ratio = (float)compressed_size / fileSize;
-        printf("Compression ratio: %.2f%%\n", (1.0 - ratio) * 100);
+            snprintf(name, sizeof(name), "synthetic %s %zuK", kinds[k], sizes[i] >> 10);
+            if (!benchmarkInput(name, data, sizes[i], json))
+                status = 1;
+            free(data);
+            }
+        }
+
+    for (int i = 0; i < count; i++) {
+        struct MappedFile map = { NULL, 0 };
+        FILE* f = fopen(files[i], "rb");
+        if (f == NULL || !mapInputFile(f, &map)) {
+            printf("ERROR: Cannot read %s\n", files[i]);
+            if (f != NULL)
+                fclose(f);
+            status = 1;
+            continue;
+            }
+        fclose(f);
+
+        if (!benchmarkInput(files[i], map.data, map.size, json))
+            status = 1;
+        unmapFile(&map);
         }
+
+    if (json != NULL)
+        fclose(json);
+    return status;
     }
 
-// Decompress the input file and write to output file
-void decompressFile(const char* input_file, const char* output_file)
+// Train a table on sample files (-t) and save it. Prints the table ID that
+// compressed files will reference and the size the samples code to.
+int trainFiles(const char* table_path, int count, char* files[])
     {
-    FILE* in, * out;
-    int size, i, j, freq;
-    unsigned char ch;
+    uint64_t freq[MAX_CHARS] = { 0 };
+    uint64_t total = 0;
 
-    printf("Starting decompression...\n");
-    printf("Opening input file: %s\n", input_file);
+    if (count == 0) {
+        printf("ERROR: No sample files to train on\n");
+        return 1;
+        }
 
-    // Open input file
-    in = fopen(input_file, "rb");
-    if (in == NULL) {
-        printf("Error opening input file\n");
-        return;
+    unsigned char* buffer = (unsigned char*)malloc(IO_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printf("ERROR: Memory allocation failed\n");
+        return 1;
         }
 
-    printf("Input file opened successfully\n");
-    printf("Opening output file: %s\n", output_file);
+    for (int i = 0; i < count; i++) {
+        FILE* f = fopen(files[i], "rb");
+        if (f == NULL) {
+            printf("ERROR: Cannot read %s\n", files[i]);
+            free(buffer);
+            return 1;
+            }
+        size_t got;
+        while ((got = fread(buffer, 1, IO_BUFFER_SIZE, f)) > 0) {
+            countBufferFrequency(buffer, got, freq);
+            total += got;
+            }
+        fclose(f);
+        }
+    free(buffer);
 
-    // Open output file
-    out = fopen(output_file, "wb");
-    if (out == NULL) {
-        printf("Error opening output file\n");
-        fclose(in);
-        return;
+    unsigned char file[TABLE_FILE_SIZE];
+    int lens[MAX_CHARS];
+    trainTable(freq, maxCodeLength, file);
+    readCodeLengths(file + FORMAT_MAGIC_LEN + 4, lens);
+
+    FILE* out = fopen(table_path, "wb");
+    if (out == NULL || fwrite(file, 1, TABLE_FILE_SIZE, out) != TABLE_FILE_SIZE) {
+        printf("ERROR: Failed to write table file %s\n", table_path);
+        if (out != NULL)
+            fclose(out);
+        return 1;
         }
+    fclose(out);
 
-    printf("Output file opened successfully\n");
-    printf("Reading header information...\n");
+    printf("Trained table %08x on %d files (%llu bytes)", tableId(file + FORMAT_MAGIC_LEN + 4), count,
+        (unsigned long long)total);
+    if (total > 0)
+        printf(", %.3f bits per byte", (double)codedBits(freq, lens) / total);
+    printf("\n");
+    return 0;
+    }
 
-    // Read header
-    if (fread(&size, sizeof(int), 1, in) != 1) {
-        printf("ERROR: Failed to read header size\n");
-        fclose(in);
-        fclose(out);
-        return;
+// Load a table file (-D) into the table cache. Returns 0 if it isn't valid.
+int loadTableFile(const char* path)
+    {
+    unsigned char file[TABLE_FILE_SIZE + 1];
+    FILE* f = fopen(path, "rb");
+    size_t size = f ? fread(file, 1, sizeof(file), f) : 0;
+    if (f != NULL)
+        fclose(f);
+
+    struct TrainedTable* table = loadTable(&tableCache, file, size);
+    if (table == NULL) {
+        printf("ERROR: %s is not a usable table file\n", path);
+        return 0;
         }
+    dictTable = table;
+    return 1;
+    }
 
-    if (size <= 0 || size > MAX_CHARS) {
-        printf("ERROR: Invalid character count in header: %d\n", size);
-        fclose(in);
-        fclose(out);
-        return;
+// Build the output path for a batch input. rel is the name to keep below the
+// output directory: compressing adds ".huf", decompressing strips it (or adds
+// ".out" when it isn't there).
+char* batchOutputPath(const char* rel, const char* out_dir, char mode)
+    {
+    size_t rel_len = strlen(rel);
+    size_t dir_len = out_dir != NULL ? strlen(out_dir) : 0;
+    size_t ext_len = strlen(COMPRESSED_EXT);
+    char* path = (char*)malloc(dir_len + rel_len + ext_len + 2);
+    if (path == NULL)
+        return NULL;
+
+    path[0] = '\0';
+    if (out_dir != NULL) {
+        strcpy(path, out_dir);
+        if (dir_len > 0 && out_dir[dir_len - 1] != '/')
+            strcat(path, "/");
         }
+    strcat(path, rel);
 
-    printf("Found %d unique characters in header\n", size);
+    size_t len = strlen(path);
+    if (mode == 'c')
+        strcat(path, COMPRESSED_EXT);
+    else if (rel_len > ext_len && strcmp(rel + rel_len - ext_len, COMPRESSED_EXT) == 0)
+        path[len - ext_len] = '\0';
+    else
+        strcat(path, DECOMPRESSED_EXT);
+    return path;
+    }
 
-    unsigned char chars[MAX_CHARS];
-    int freqs[MAX_CHARS];
+// Queue one input file. Returns 0 when out of memory.
+int batchAdd(struct BatchList* list, const char* input, const char* rel, uint64_t size)
+    {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        struct BatchJob* job = (struct BatchJob*)realloc(list->job, capacity * sizeof(*job));
+        if (job == NULL)
+            return 0;
+        list->job = job;
+        list->capacity = capacity;
+        }
 
-    for (i = 0; i < size; i++) {
-        if (fread(&chars[i], sizeof(unsigned char), 1, in) != 1 ||
-            fread(&freqs[i], sizeof(int), 1, in) != 1) {
-            printf("ERROR: Failed to read character data from header\n");
-            fclose(in);
-            fclose(out);
-            return;
-            }
+    struct BatchJob* job = &list->job[list->count];
+    job->input = strdup(input);
+    job->output = batchOutputPath(rel, list->out_dir, list->mode);
+    job->size = size;
+    job->state = list;
+    if (job->input == NULL || job->output == NULL) {
+        free(job->input);
+        free(job->output);
+        return 0;
+        }
+    list->count++;
+    return 1;
+    }
+
+// Queue the files below a directory (-r). Compression skips files that are
+// already compressed; decompression takes only those.
+int batchWalk(struct BatchList* list, const char* dir, const char* rel)
+    {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        printf("ERROR: Cannot open directory %s\n", dir);
+        return 0;
         }
 
-    printf("Rebuilding Huffman tree...\n");
+    int ok = 1;
+    size_t ext_len = strlen(COMPRESSED_EXT);
+    struct dirent* entry;
+    while (ok && (entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
 
-    // Rebuild Huffman tree
-    struct MinHeapNode* root = buildHuffmanTree(chars, freqs, size);
+        size_t name_len = strlen(name);
+        char* path = (char*)malloc(strlen(dir) + name_len + 2);
+        char* sub = (char*)malloc(strlen(rel) + name_len + 2);
+        if (path == NULL || sub == NULL) {
+            free(path);
+            free(sub);
+            ok = 0;
+            break;
+            }
+        sprintf(path, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+        sprintf(sub, "%s%s%s", rel, rel[0] ? "/" : "", name);
 
-    // Calculate total characters to decode
-    int total_chars = 0;
-    for (i = 0; i < size; i++) {
-        total_chars += freqs[i];
-        if (chars[i] >= 32 && chars[i] <= 126) { // Printable ASCII
-            printf("Character '%c' appears %d times\n", chars[i], freqs[i]);
+        // Symbolic links are not followed, so a link cannot loop the walk
+        struct stat st;
+        if (lstat(path, &st) == 0) {
+            int packed = name_len > ext_len && strcmp(name + name_len - ext_len, COMPRESSED_EXT) == 0;
+            if (S_ISDIR(st.st_mode))
+                ok = batchWalk(list, path, sub);
+            else if (S_ISREG(st.st_mode) && packed == (list->mode == 'd'))
+                ok = batchAdd(list, path, sub, (uint64_t)st.st_size);
             }
-        else {
-            printf("Character (ASCII %d) appears %d times\n", chars[i], freqs[i]);
+        free(path);
+        free(sub);
+        }
+    closedir(d);
+    return ok;
+    }
+
+// Queue one command line argument: a file, a directory with -r, or a glob
+// pattern the shell did not expand. Returns 0 when nothing usable was found.
+int batchCollect(struct BatchList* list, const char* arg, int recursive)
+    {
+    if (strpbrk(arg, "*?[") != NULL) {
+        glob_t matches;
+        if (glob(arg, 0, NULL, &matches) == 0) {
+            int ok = 1;
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+                ok &= batchCollect(list, matches.gl_pathv[i], recursive);
+            globfree(&matches);
+            return ok;
             }
         }
 
-    printf("Decompressing %d characters...\n", total_chars);
+    struct stat st;
+    if (stat(arg, &st) != 0) {
+        printf("ERROR: Cannot find %s\n", arg);
+        return 0;
+        }
+    if (S_ISDIR(st.st_mode)) {
+        if (!recursive) {
+            printf("ERROR: %s is a directory (use -r)\n", arg);
+            return 0;
+            }
+        return batchWalk(list, arg, "");
+        }
 
-    // Decode
-    int decoded_chars = 0;
-    struct MinHeapNode* current = root;
-    unsigned char bit;
-    int progress = 0;
+    const char* slash = strrchr(arg, '/');
+    const char* rel = list->out_dir != NULL && slash != NULL ? slash + 1 : arg;
+    return batchAdd(list, arg, rel, (uint64_t)st.st_size);
+    }
 
-    while (decoded_chars < total_chars) {
-        if (fread(&ch, sizeof(unsigned char), 1, in) != 1) {
-            printf("WARNING: Unexpected end of compressed file\n");
-            break;
+// Create the directories leading up to path
+int makeParentDirs(const char* path)
+    {
+    char* dir = strdup(path);
+    if (dir == NULL)
+        return 0;
+
+    for (char* p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            printf("ERROR: Cannot create directory %s\n", dir);
+            free(dir);
+            return 0;
             }
+        *p = '/';
+        }
+    free(dir);
+    return 1;
+    }
 
-        for (i = 0; i < 8 && decoded_chars < total_chars; i++) {
-            bit = (ch >> i) & 1;
+// Compress or decompress one file of a batch and add it to the totals
+void batchTask(void* arg)
+    {
+    struct BatchJob* job = (struct BatchJob*)arg;
+    struct BatchList* list = job->state;
+    int ok = 0;
 
-            if (bit == 0)
-                current = current->left;
-            else
-                current = current->right;
+    if (!list->force && access(job->output, F_OK) == 0) {
+        printf("ERROR: %s already exists (use -f to overwrite)\n", job->output);
+        }
+    else if (makeParentDirs(job->output)) {
+        ok = list->mode == 'c' ? compressFile(job->input, job->output) : decompressFile(job->input, job->output);
+        // Leave nothing half-written behind
+        if (!ok)
+            unlink(job->output);
+        }
 
-            if (current == NULL) {
-                printf("ERROR: Invalid Huffman tree traversal\n");
-                fclose(in);
-                fclose(out);
-                return;
-                }
+    struct stat in_st, out_st;
+    if (ok && (stat(job->input, &in_st) != 0 || stat(job->output, &out_st) != 0))
+        ok = 0;
+
+    pthread_mutex_lock(&list->lock);
+    if (ok) {
+        list->bytes_in += (uint64_t)in_st.st_size;
+        list->bytes_out += (uint64_t)out_st.st_size;
+        }
+    else {
+        list->failed++;
+        printf("FAILED %s\n", job->input);
+        }
+    pthread_mutex_unlock(&list->lock);
+    __atomic_fetch_add(&progressState.done, job->size, __ATOMIC_RELAXED);
+    }
+
+// Largest files first, so the last file to start is a small one
+static int compareBatchJob(const void* a, const void* b)
+    {
+    const struct BatchJob* x = (const struct BatchJob*)a;
+    const struct BatchJob* y = (const struct BatchJob*)b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return strcmp(x->input, y->input);
+    }
 
-            if (isLeaf(current)) {
-                fwrite(&current->data, sizeof(unsigned char), 1, out);
-                decoded_chars++;
-                current = root;
+// Compress or decompress many files without prompts, several at a time; -v
+// prints one summary at the end. Returns the process exit status.
+int batchRun(char mode, int count, char* args[], const char* out_path, int recursive, int force, int workers)
+    {
+    struct BatchList list = { 0 };
+    list.mode = mode;
+    list.force = force;
 
-                int new_progress = (decoded_chars * 100) / total_chars;
-                if (new_progress / 10 > progress / 10) {
-                    progress = new_progress;
-                    printf("Decompression progress: %d%% complete\n", progress);
-                    }
-                }
+    // One input and an output that isn't a directory: -o names the file
+    struct stat st;
+    int out_is_dir = out_path != NULL && stat(out_path, &st) == 0 && S_ISDIR(st.st_mode);
+    int single = out_path != NULL && !out_is_dir && !recursive && count == 1 && strpbrk(args[0], "*?[") == NULL;
+    if (out_path != NULL && !single) {
+        if (!out_is_dir && mkdir(out_path, 0777) != 0) {
+            printf("ERROR: Cannot create output directory %s\n", out_path);
+            return 1;
             }
+        list.out_dir = out_path;
         }
 
-    // Close files
-    fclose(in);
-    fclose(out);
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        if (!batchCollect(&list, args[i], recursive))
+            status = 1;
+        }
+    if (single && list.count == 1) {
+        free(list.job[0].output);
+        list.job[0].output = strdup(out_path);
+        if (list.job[0].output == NULL)
+            list.count = 0;
+        }
+    qsort(list.job, list.count, sizeof(*list.job), compareBatchJob);
+
+    // Files are the unit of parallelism; each is coded on one thread so
+    // memory stays bounded by the number of workers. Progress counts the
+    // bytes of finished files.
+    int summary = verbose;
+    uint64_t total_size = 0;
+    for (size_t i = 0; i < list.count; i++)
+        total_size += list.job[i].size;
+    progressBegin("Files", total_size);
+    progressState.batch = 1;
+    verbose = 0;
+    numThreads = 1;
+    pthread_mutex_init(&list.lock, NULL);
+
+    double start_time = getTimeSeconds();
+    struct ThreadPool pool;
+    if (!poolInit(&pool, workers < (int)list.count ? workers : (int)list.count)) {
+        printf("ERROR: Failed to start worker threads\n");
+        status = 1;
+        }
+    else {
+        for (size_t i = 0; i < list.count; i++)
+            poolSubmit(&pool, batchTask, &list.job[i]);
+        poolWait(&pool);
+        poolDestroy(&pool);
+        }
+    double elapsed = getTimeSeconds() - start_time;
+    pthread_mutex_destroy(&list.lock);
+
+    if (summary) {
+        printf("Processed %zu files, %llu failed\n", list.count, (unsigned long long)list.failed);
+        printf("Total: %llu -> %llu bytes", (unsigned long long)list.bytes_in, (unsigned long long)list.bytes_out);
+        if (list.bytes_in > 0 && mode == 'c')
+            printf(" (%.2f%% of original)", 100.0 * list.bytes_out / list.bytes_in);
+        printf(" in %.2f seconds", elapsed);
+        if (elapsed > 0)
+            printf(", %.2f MB/s", (mode == 'c' ? list.bytes_in : list.bytes_out) / elapsed / 1e6);
+        printf("\n");
+        }
 
-    printf("File decompressed successfully.\n");
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.job[i].input);
+        free(list.job[i].output);
+        }
+    free(list.job);
+    return status || list.failed > 0;
     }
 
-int main()
+#ifndef HUFF_NO_MAIN
+int main(int argc, char* argv[])
     {
-    char option;
+    char option = 0;
     char input_file[MAX_PATH_LEN];
     char output_file[MAX_PATH_LEN];
     int input_valid = 0;
     int output_valid = 0;
 
+    int block_size_set = 0;
+    int threads_set = 0;
+    const char* out_path = NULL;
+    int recursive = 0;
+    int force = 0;
+    int opt;
+    const char* train_path = NULL;
+    int range_set = 0;
+    uint64_t range_offset = 0, range_length = UINT64_MAX;
+    while ((opt = getopt(argc, argv, "cdBHMS4ACrfvpo:l:b:T:n:j:q:t:D:z:w:R:k:")) != -1) {
+        if (opt == 'c' || opt == 'd' || opt == 'B' || opt == 'H') {
+            option = (char)opt;
+            }
+        else if (opt == 'M') {
+            useMmap = 0;
+            }
+        else if (opt == '4') {
+            useStreams = 1;
+            }
+        else if (opt == 'A') {
+            useAns = 0;
+            }
+        else if (opt == 'C') {
+            useContext = 1;
+            }
+        else if (opt == 'S') {
+            sampleMode = 1;
+            }
+        else if (opt == 'v') {
+            verbose = 1;
+            }
+        else if (opt == 'p') {
+            showProgress = 1;
+            }
+        else if (opt == 't') {
+            option = 't';
+            train_path = optarg;
+            }
+        else if (opt == 'D') {
+            if (!loadTableFile(optarg))
+                return 1;
+            }
+        else if (opt == 'q') {
+            ioDepth = atoi(optarg);
+            if (ioDepth < 0 || ioDepth > MAX_IO_DEPTH) {
+                printf("Invalid queue depth. Please use 0 to %d buffers.\n", MAX_IO_DEPTH);
+                return 1;
+                }
+            }
+        else if (opt == 'o') {
+            out_path = optarg;
+            }
+        else if (opt == 'r') {
+            recursive = 1;
+            }
+        else if (opt == 'f') {
+            force = 1;
+            }
+        else if (opt == 'n') {
+            benchRuns = atoi(optarg);
+            if (benchRuns < 1) {
+                printf("Invalid run count. Please use 1 or more.\n");
+                return 1;
+                }
+            }
+        else if (opt == 'j') {
+            jsonPath = optarg;
+            }
+        else if (opt == 'k') {
+            if (!selectKernels(optarg)) {
+                printf("ERROR: No '%s' kernels for this CPU\n", optarg);
+                return 1;
+                }
+            }
+        else if (opt == 'z') {
+            lzLevel = atoi(optarg);
+            if (lzLevel < 0 || lzLevel > LZ_MAX_LEVEL) {
+                printf("Invalid match level. Please use 0 to %d.\n", LZ_MAX_LEVEL);
+                return 1;
+                }
+            }
+        else if (opt == 'w') {
+            long kb = atol(optarg);
+            if (kb < 1 || (size_t)kb > (MAX_BLOCK_SIZE >> 10)) {
+                printf("Invalid match window. Please use 1 to %zu KB.\n", MAX_BLOCK_SIZE >> 10);
+                return 1;
+                }
+            lzWindow = (size_t)kb << 10;
+            }
+        else if (opt == 'R') {
+            // offset:length, or offset alone for everything after it
+            char* end;
+            range_offset = strtoull(optarg, &end, 10);
+            if (*end == ':' && end[1] != '\0')
+                range_length = strtoull(end + 1, &end, 10);
+            else if (*end == ':')
+                end++;
+            if (end == optarg || *end != '\0' || optarg[0] == '-') {
+                printf("Invalid range. Please use -R offset:length (in bytes).\n");
+                return 1;
+                }
+            range_set = 1;
+            }
+        else if (opt == 'l') {
+            maxCodeLength = atoi(optarg);
+            if (maxCodeLength < 1 || maxCodeLength > MAX_CODE_LEN) {
+                printf("Invalid code length limit. Please use 1 to %d bits.\n", MAX_CODE_LEN);
+                return 1;
+                }
+            }
+        else if (opt == 'b') {
+            long kb = atol(optarg);
+            if (kb < 0 || (size_t)kb > (MAX_BLOCK_SIZE >> 10)) {
+                printf("Invalid block size. Please use 1 to %zu KB (0 for one stream).\n", MAX_BLOCK_SIZE >> 10);
+                return 1;
+                }
+            blockSize = (size_t)kb << 10;
+            block_size_set = 1;
+            }
+        else if (opt == 'T') {
+            numThreads = atoi(optarg);
+            if (numThreads == 0)
+                numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (numThreads < 1 || numThreads > MAX_THREADS) {
+                printf("Invalid thread count. Please use 1 to %d (0 for all cores).\n", MAX_THREADS);
+                return 1;
+                }
+            threads_set = 1;
+            if (!block_size_set)
+                blockSize = DEFAULT_BLOCK_SIZE;
+            }
+        else {
+            printf("Usage: %s [-l max_code_bits] [-b block_kb] [-T threads] [-q depth] [-4] [-M] [-S]\n", argv[0]);
+            printf("       [-z level] [-w window_kb]   (match repeats first, 1 fast to %d thorough)\n", LZ_MAX_LEVEL);
+            printf("       [-A]   (Huffman codes only, no tANS blocks)\n");
+            printf("       [-C]   (order-1 context tables where they code smaller)\n");
+            printf("       [-k generic|bmi2]   (force a kernel set; default: the best this CPU runs)\n");
+            printf("       [-v] [-p] [-j stats.json]   (messages, progress, codec stats)\n");
+            printf("       %s -c|-d [options] [input [output]]   (default: stdin to stdout)\n", argv[0]);
+            printf("       %s -c|-d [options] [-r] [-f] [-o output] input...   (batch)\n", argv[0]);
+            printf("       %s -d -R offset:length input [output]   (decode only that range)\n", argv[0]);
+            printf("       %s -t table [-l bits] sample...   (train a table; use it with -D table)\n", argv[0]);
+            printf("       %s -B [-n runs] [-j results.json] [-l bits] [-4] [file...]   (benchmark)\n", argv[0]);
+            printf("       %s -H [-n runs] [-T threads] [file...]   (histogram benchmark)\n", argv[0]);
+            return 1;
+            }
+        }
+
+    if (option == 'B')
+        return benchmarkCorpus(argc - optind, argv + optind);
+    if (option == 'H')
+        return benchmarkHistogram(argc - optind, argv + optind);
+    if (option == 't')
+        return trainFiles(train_path, argc - optind, argv + optind);
+
+    // Interleaved streams, matches and context tables are block format features
+    if ((useStreams || lzLevel > 0 || useContext) && !block_size_set)
+        blockSize = DEFAULT_BLOCK_SIZE;
+
+    // Batch mode: -o, -r or more inputs than an input/output pair. Files are
+    // spread over -T workers (all cores by default), one thread each.
+    int positional = argc - optind;
+    if (range_set && (option != 'd' || out_path != NULL || recursive || positional > 2)) {
+        printf("ERROR: -R reads a range from one file with -d\n");
+        return 1;
+        }
+    if (option != 0 && (out_path != NULL || recursive || positional > 2)) {
+        if (positional == 0) {
+            printf("ERROR: No input files\n");
+            return 1;
+            }
+        int workers = threads_set ? numThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers > MAX_THREADS)
+            workers = MAX_THREADS;
+
+        double start_time = getTimeSeconds();
+        if (showProgress)
+            progressStart();
+        int status = batchRun(option, positional, argv + optind, out_path, recursive, force, workers);
+        progressStop();
+        if (jsonPath != NULL &&
+            !writeStatsJson(jsonPath, option == 'c' ? "compress" : "decompress", !status, getTimeSeconds() - start_time))
+            status = 1;
+        return status;
+        }
+
+    // Non-interactive mode; "-" or a missing path means stdin/stdout, so the
+    // tool can sit in the middle of a pipeline
+    if (option != 0) {
+        const char* in_path = optind < argc ? argv[optind] : "-";
+        const char* single_out = optind + 1 < argc ? argv[optind + 1] : "-";
+
+        if (strcmp(single_out, "-") == 0)
+            reserveStdout();
+
+        double start_time = getTimeSeconds();
+        if (showProgress)
+            progressStart();
+        int ok;
+        if (option == 'c')
+            ok = compressFile(in_path, single_out);
+        else if (range_set)
+            ok = decompressRange(in_path, single_out, range_offset, range_length);
+        else
+            ok = decompressFile(in_path, single_out);
+        progressStop();
+        if (jsonPath != NULL &&
+            !writeStatsJson(jsonPath, option == 'c' ? "compress" : "decompress", ok, getTimeSeconds() - start_time))
+            ok = 0;
+        return !ok;
+        }
+
+    // The interactive session talks the user through each step
+    verbose = 1;
     printf("Text File Compression System\n");
     printf("----------------------------\n");
 
@@ -686,14 +7220,14 @@ int main()
     // Get input file path and validate
     while (!input_valid) {
         printf("Enter input file path: ");
-        scanf("%s", input_file);
+        scanf("%4095s", input_file);
         input_valid = validatePath(input_file, 1);
         }
 
     // Get output file path and validate
     while (!output_valid) {
         printf("Enter output file path: ");
-        scanf("%s", output_file);
+        scanf("%4095s", output_file);
         output_valid = validatePath(output_file, 0);
         }
 
@@ -704,4 +7238,5 @@ int main()
         decompressFile(input_file, output_file);
 
     return 0;
-    }
\ No newline at end of file
+    }
+#endif
@@ -0,0 +1,120 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory interface to the Huffman codec. Compressed buffers use the block
+// file format (version 3, with block index), so they can be written out and
+// decompressed by the command line tool, and its files can be passed to
+// huff_decompress. Nothing here prints or exits; failures come back as the
+// negative codes below. Build the codec without the command line front end
+// by compiling compression.c with -DHUFF_NO_MAIN.
+
+#define HUFF_ERROR_MEMORY (-1)         // Allocation failed
+#define HUFF_ERROR_DST_TOO_SMALL (-2)  // Output doesn't fit in dst
+#define HUFF_ERROR_CORRUPT (-3)        // Compressed data is damaged or truncated
+#define HUFF_ERROR_FORMAT (-4)         // Not a format this library reads
+#define HUFF_ERROR_ARGUMENT (-5)       // Invalid parameter
+#define HUFF_ERROR_TABLE (-6)          // Data needs a trained table that isn't loaded
+#define HUFF_ERROR_IO (-7)             // File can't be opened or mapped
+
+// Holds settings, scratch memory and the last decode table between calls.
+// A context may be reused for any number of calls but not by two threads at once.
+typedef struct huff_ctx huff_ctx;
+
+huff_ctx* huff_ctx_create(void);
+void huff_ctx_free(huff_ctx* ctx);
+
+// Longest code the compressor emits (1 to 15, default 15)
+int huff_ctx_set_max_code_length(huff_ctx* ctx, int bits);
+
+// Split blocks into four interleaved bitstreams for faster decoding (default 0)
+int huff_ctx_set_streams(huff_ctx* ctx, int enable);
+
+// Code blocks with tANS instead of Huffman codes where that is smaller
+// (default 1); 0 keeps every block to Huffman codes
+int huff_ctx_set_ans(huff_ctx* ctx, int enable);
+
+// Code each byte with one of up to 16 Huffman codes picked by the byte before
+// it, where that comes out smaller than one code per block (default 0)
+int huff_ctx_set_context(huff_ctx* ctx, int enable);
+
+// Replace repeats inside each 1 MB block with matches before Huffman coding:
+// level 1 (fastest) to 9 (best ratio), 0 for none (default). Matches reach
+// back at most window bytes (0 for the default of 1 MB).
+int huff_ctx_set_lz(huff_ctx* ctx, int level, size_t window);
+
+// Work counted by a context: bytes passed in and out of huff_compress and
+// huff_decompress, nanoseconds spent in each codec stage, code tables built
+// and blocks coded
+typedef struct huff_stats {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t histogram_ns;
+    uint64_t match_ns;
+    uint64_t tables_ns;
+    uint64_t coding_ns;
+    uint64_t tables_built;
+    uint64_t blocks;
+    } huff_stats;
+
+// Count work in the context from now on (clearing the counters), or stop
+// counting (default 0). Stage times read the clock a few times per block.
+int huff_ctx_set_stats(huff_ctx* ctx, int enable);
+int huff_ctx_get_stats(const huff_ctx* ctx, huff_stats* stats);
+
+// Dictionary mode for small messages: a table trained on sample messages is
+// shared by both sides, and each message only names the table's ID instead of
+// carrying its own code lengths. Table images are HUFF_TABLE_SIZE bytes, the
+// same as the table files of the command line tool.
+#define HUFF_TABLE_SIZE 136
+
+// Train a table on count samples and write its image to table. Every byte
+// value gets a code, so the table can code any message.
+int huff_train(const void* const samples[], const size_t sizes[], size_t count, int max_code_length, void* table);
+
+// Load a table image into the context, with its coding tables built once.
+// Returns the table ID or an error. Up to 64 tables can be loaded; messages
+// coded with any of them decompress with this context.
+int64_t huff_ctx_load_table(huff_ctx* ctx, const void* table, size_t size);
+
+// Code later huff_compress calls with a loaded table (a negative ID turns it off)
+int huff_ctx_use_table(huff_ctx* ctx, int64_t id);
+
+// Largest compressed size of n input bytes
+size_t huff_compress_bound(size_t n);
+
+// Compress n bytes from src into dst. Returns the compressed size or an error.
+int64_t huff_compress(huff_ctx* ctx, const void* src, size_t n, void* dst, size_t cap);
+
+// Original size of the data in a compressed buffer, or an error
+int64_t huff_decompressed_size(const void* src, size_t size);
+
+// Decompress src into dst. Returns the decompressed size or an error.
+int64_t huff_decompress(huff_ctx* ctx, const void* src, size_t size, void* dst, size_t cap);
+
+// Random access to compressed data in the block format (version 3, written
+// by huff_compress and by the command line tool with -b or -T). A read
+// decodes only the blocks that cover the requested range. The last 4 blocks
+// it decoded are kept, so nearby reads are served without decoding again.
+// A reader may be used by one thread at a time.
+typedef struct huff_reader huff_reader;
+
+// Open a compressed file, memory-mapped, or a buffer that must stay valid
+// until the reader is closed. Returns 0 or an error.
+int huff_reader_open(const char* path, huff_reader** reader);
+int huff_reader_open_buffer(const void* src, size_t size, huff_reader** reader);
+void huff_reader_close(huff_reader* reader);
+
+// Original size of the data
+int64_t huff_reader_size(const huff_reader* reader);
+
+// Copy len bytes starting at original byte offset into dst. Returns the bytes
+// copied, fewer at the end of the data and 0 past it, or an error.
+int64_t huff_reader_read(huff_reader* reader, uint64_t offset, void* dst, size_t len);
+
+// Short description of a return code
+const char* huff_error_name(int64_t code);
+
+#endif